@@ -0,0 +1,219 @@
+/*
+ * Copyright (c) 2016 Nathan Holstein <nathan.holstein@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Only the wrappers' declarations are wanted here; the real allocator
+ * is called by name below.
+ */
+#include "allocstats.h"
+#undef malloc
+#undef calloc
+#undef realloc
+#undef reallocarray
+#undef strdup
+#undef free
+
+#define MAXSITES	256
+
+/*
+ * Each block carries its size in front of it so that live bytes can be
+ * tracked through realloc() and free().
+ */
+union header {
+	size_t size;
+	max_align_t align;
+};
+
+struct site {
+	const char *file;
+	int line;
+	int phase;
+	uint64_t count;
+	uint64_t bytes;
+};
+
+static pthread_mutex_t alloclock = PTHREAD_MUTEX_INITIALIZER;
+static struct site sites[MAXSITES];
+static int nsites;
+static uint64_t count[ALLOC_NPHASES], bytes[ALLOC_NPHASES];
+static size_t live, peak;
+static int phase;
+static int registered, reported;
+
+static const char *phasenames[ALLOC_NPHASES] = {
+	"other", "parse", "permit", "env",
+};
+
+static void
+record(const char *file, int line, size_t oldsize, size_t size)
+{
+	int i;
+
+	pthread_mutex_lock(&alloclock);
+	if (!registered) {
+		registered = 1;
+		atexit(allocstats_report);
+	}
+	count[phase]++;
+	bytes[phase] += size;
+	live = live - oldsize + size;
+	if (live > peak)
+		peak = live;
+	for (i = 0; i < nsites; i++)
+		if (sites[i].line == line && sites[i].phase == phase &&
+		    strcmp(sites[i].file, file) == 0)
+			break;
+	if (i == nsites && nsites < MAXSITES) {
+		sites[i].file = file;
+		sites[i].line = line;
+		sites[i].phase = phase;
+		nsites++;
+	}
+	if (i < nsites) {
+		sites[i].count++;
+		sites[i].bytes += size;
+	}
+	pthread_mutex_unlock(&alloclock);
+}
+
+void *
+allocstats_realloc(void *p, size_t size, const char *file, int line)
+{
+	union header *h = p ? (union header *)p - 1 : NULL;
+	size_t oldsize = h ? h->size : 0;
+
+	if (size > SIZE_MAX - sizeof(*h)) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	if (!(h = realloc(h, sizeof(*h) + size)))
+		return NULL;
+	h->size = size;
+	record(file, line, oldsize, size);
+	return h + 1;
+}
+
+void *
+allocstats_malloc(size_t size, const char *file, int line)
+{
+	return allocstats_realloc(NULL, size, file, line);
+}
+
+void *
+allocstats_reallocarray(void *p, size_t nmemb, size_t size, const char *file,
+    int line)
+{
+	if (size && nmemb > SIZE_MAX / size) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	return allocstats_realloc(p, nmemb * size, file, line);
+}
+
+void *
+allocstats_calloc(size_t nmemb, size_t size, const char *file, int line)
+{
+	void *p;
+
+	if (!(p = allocstats_reallocarray(NULL, nmemb, size, file, line)))
+		return NULL;
+	memset(p, 0, nmemb * size);
+	return p;
+}
+
+char *
+allocstats_strdup(const char *s, const char *file, int line)
+{
+	size_t len = strlen(s) + 1;
+	char *p;
+
+	if (!(p = allocstats_malloc(len, file, line)))
+		return NULL;
+	memcpy(p, s, len);
+	return p;
+}
+
+void
+allocstats_free(void *p)
+{
+	union header *h;
+
+	if (!p)
+		return;
+	h = (union header *)p - 1;
+	pthread_mutex_lock(&alloclock);
+	live -= h->size;
+	pthread_mutex_unlock(&alloclock);
+	free(h);
+}
+
+/* Attribute the following allocations to a phase of the decision. */
+void
+allocstats_phase(int p)
+{
+	pthread_mutex_lock(&alloclock);
+	phase = p;
+	pthread_mutex_unlock(&alloclock);
+}
+
+static int
+sitecmp(const void *a, const void *b)
+{
+	const struct site *sa = a, *sb = b;
+
+	if (sa->bytes != sb->bytes)
+		return sa->bytes < sb->bytes ? 1 : -1;
+	return 0;
+}
+
+/*
+ * Write the totals to stderr, once: at exit, or just before doas
+ * executes the command.
+ */
+void
+allocstats_report(void)
+{
+	int i;
+
+	pthread_mutex_lock(&alloclock);
+	if (reported) {
+		pthread_mutex_unlock(&alloclock);
+		return;
+	}
+	reported = 1;
+	fprintf(stderr, "allocstats: phase\tallocs\tbytes\n");
+	for (i = 0; i < ALLOC_NPHASES; i++)
+		fprintf(stderr, "allocstats: %s\t%" PRIu64 "\t%" PRIu64 "\n",
+		    phasenames[i], count[i], bytes[i]);
+	fprintf(stderr, "allocstats: peak %zu live %zu\n", peak, live);
+	qsort(sites, nsites, sizeof(*sites), sitecmp);
+	for (i = 0; i < nsites; i++)
+		fprintf(stderr, "allocstats: %s:%d\t%s\t%" PRIu64 "\t%" PRIu64
+		    "\n", sites[i].file, sites[i].line,
+		    phasenames[sites[i].phase], sites[i].count, sites[i].bytes);
+	pthread_mutex_unlock(&alloclock);
+}
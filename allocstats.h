@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2016 Nathan Holstein <nathan.holstein@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Allocation accounting for the instrumented build (make ALLOCSTATS=1).
+ * This header must be included after every system header, since it
+ * replaces the allocator with counting wrappers that record the call
+ * site.  In a normal build it only provides no-op phase markers.
+ */
+
+#define ALLOC_OTHER	0
+#define ALLOC_PARSE	1
+#define ALLOC_PERMIT	2
+#define ALLOC_ENV	3
+#define ALLOC_NPHASES	4
+
+#ifdef ALLOCSTATS
+
+void *allocstats_malloc(size_t, const char *, int);
+void *allocstats_calloc(size_t, size_t, const char *, int);
+void *allocstats_realloc(void *, size_t, const char *, int);
+void *allocstats_reallocarray(void *, size_t, size_t, const char *, int);
+char *allocstats_strdup(const char *, const char *, int);
+void allocstats_free(void *);
+void allocstats_phase(int);
+void allocstats_report(void);
+
+#undef malloc
+#undef calloc
+#undef realloc
+#undef reallocarray
+#undef strdup
+#undef free
+#define malloc(n)		allocstats_malloc(n, __FILE__, __LINE__)
+#define calloc(n, s)		allocstats_calloc(n, s, __FILE__, __LINE__)
+#define realloc(p, n)		allocstats_realloc(p, n, __FILE__, __LINE__)
+#define reallocarray(p, n, s)	allocstats_reallocarray(p, n, s, \
+				    __FILE__, __LINE__)
+#define strdup(s)		allocstats_strdup(s, __FILE__, __LINE__)
+#define free(p)			allocstats_free(p)
+
+#else
+
+#define allocstats_phase(phase)	do { } while (0)
+#define allocstats_report()	do { } while (0)
+
+#endif
@@ -7,6 +7,24 @@ default: ${PROG}
 
 OPENBSD:=reallocarray.c strtonum.c execvpe.c setresuid.c \
 	auth_userokay.c setusercontext.c explicit_bzero.c
+
+# make STATIC=1 DYNAMIC=/path/to/doas links a static PIE, which starts
+# without the dynamic loader.  PAM and NSS modules can't be loaded into
+# it without a second libc, so it does no password authentication and
+# reads users and groups from /etc/passwd and /etc/group alone.  A
+# request that needs a password, or names a user or group those files
+# don't have, is handed to DYNAMIC, a regular build of doas installed
+# setuid root.  Run make clean when switching between the builds.
+ifdef STATIC
+ifndef DYNAMIC
+$(error STATIC=1 does not support PAM or NSS; set DYNAMIC to the path \
+	of a regular doas build to handle the requests that need them)
+endif
+OPENBSD+= pwfiles.c
+COPTS+= -fPIE -DNOPAM -DNONSS -DDOAS_DYNAMIC='"${DYNAMIC}"'
+LDFLAGS:=$(filter-out -lpam,${LDFLAGS}) -static-pie
+endif
+
 OPENBSD:=$(addprefix libopenbsd/,${OPENBSD:.c=.o})
 libopenbsd.a: ${OPENBSD}
 	${AR} -r $@ $?
@@ -16,8 +34,13 @@ CFLAGS:=${CFLAGS} -I${CURDIR}/libopenbsd ${COPTS} -MD -MP
 OBJS:=${SRCS:.y=.c}
 OBJS:=${OBJS:.c=.o}
 
-${PROG}: ${OBJS} libopenbsd.a
-	${CC} ${CFLAGS} ${LDFLAGS} $^ -o $@
+LIBOBJS:=${LIBSRCS:.y=.c}
+LIBOBJS:=${LIBOBJS:.c=.o}
+lib${LIB}.a: ${LIBOBJS}
+	${AR} -r $@ $?
+
+${PROG}: ${OBJS} lib${LIB}.a libopenbsd.a
+	${CC} ${CFLAGS} $^ ${LDFLAGS} -o $@
 
 .%.chmod: %
 	cp $< $@
@@ -45,13 +68,16 @@ install: ${BINDIR}/${PROG} ${MAN}
 clean:
 	rm -f version.h
 	rm -f libopenbsd.a
+	rm -f lib${LIB}.a
+	rm -f ${LIBOBJS}
+	rm -f ${LIBOBJS:.o=.d}
 	rm -f ${OPENBSD}
 	rm -f ${OPENBSD:.o=.d}
 	rm -f ${OBJS}
 	rm -f ${OBJS:.o=.d}
 	rm -f ${PROG}
 
--include ${objs:.o=.d} ${OPENBSD:.o=.d}
+-include ${objs:.o=.d} ${LIBOBJS:.o=.d} ${OPENBSD:.o=.d}
 
 .PHONY: default clean install man
 .INTERMEDIATE: .${PROG}.chmod
@@ -0,0 +1,274 @@
+/*
+ * Copyright (c) 2016 Nathan Holstein <nathan.holstein@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include <limits.h>
+#include <stdatomic.h>
+#include <paths.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "policy.h"
+#include "doas.h"
+
+#define CACHE_FILE	DOAS_RUNDIR "doas.cache"
+#define CACHE_MAGIC	0x646f6463	/* "dodc" */
+#define CACHE_VERSION	1
+#define CACHE_NSETS	256
+#define CACHE_WAYS	8
+#define CACHE_TTL	600		/* seconds */
+#define DENYLOG_INTERVAL 60		/* seconds */
+
+/*
+ * The decision cache remembers the outcome of recent requests, so that
+ * the same request made again skips rule evaluation, and a repeated
+ * denied request skips parsing the config as well.  Entries are grouped
+ * in sets by the hash of their key and the least recently used entry of
+ * a set is replaced.  The command line is stored in full so that only
+ * the identical request hits; the config hash covers rule changes and
+ * the TTL covers changes to the user and group databases.  Like the
+ * metrics, the cache is only used if an administrator creates the file.
+ */
+struct cacheentry {
+	uint64_t confighash;
+	uint64_t groupshash;
+	uint32_t uid;
+	uint32_t target;
+	int64_t created;
+	int64_t used;		/* 0 if the entry is free */
+	int32_t result;		/* PERMIT or DENY */
+	int32_t rule;		/* index in the policy, -1 if none matched */
+	int32_t lineno;
+	uint32_t suppressed;	/* denials not logged since lastlog */
+	int64_t lastlog;
+	uint32_t argvlen;
+	char argv[CACHE_MAXARGV];
+};
+
+struct cachefile {
+	_Atomic uint32_t magic;
+	uint32_t version;
+	struct cacheentry set[CACHE_NSETS][CACHE_WAYS];
+};
+
+static struct cachefile *cache;
+static int cachefd = -1;
+
+/*
+ * Fill in the key of a request.  Returns -1 if its command line is too
+ * long to be cached.
+ */
+int
+cache_key(struct cachekey *key, uint64_t confighash, uid_t uid,
+    const gid_t *groups, int ngroups, uid_t target, char **argv)
+{
+	size_t len;
+
+	memset(key, 0, sizeof(*key));
+	key->confighash = confighash;
+	key->groupshash = fnvhash(FNV_INIT, groups,
+	    (size_t)ngroups * sizeof(*groups));
+	key->uid = uid;
+	key->target = target;
+	for (; *argv; argv++) {
+		len = strlen(*argv) + 1;
+		if (len > sizeof(key->argv) - key->argvlen)
+			return -1;
+		memcpy(key->argv + key->argvlen, *argv, len);
+		key->argvlen += len;
+	}
+	return 0;
+}
+
+/* The magic number is stored last, so a file that has it is complete. */
+static int
+cachevalid(struct cachefile *cf)
+{
+	return atomic_load_explicit(&cf->magic, memory_order_acquire) ==
+	    CACHE_MAGIC && cf->version == CACHE_VERSION;
+}
+
+void
+cache_open(void)
+{
+	struct cachefile *cf;
+	int fd;
+
+	if (!(cf = mapshared(CACHE_FILE, sizeof(*cf), 0, &fd)))
+		return;
+	if (!cachevalid(cf)) {
+		sharedlock(fd);
+		if (!cachevalid(cf)) {
+			atomic_store_explicit(&cf->magic, 0,
+			    memory_order_relaxed);
+			memset(cf->set, 0, sizeof(cf->set));
+			cf->version = CACHE_VERSION;
+			atomic_store_explicit(&cf->magic, CACHE_MAGIC,
+			    memory_order_release);
+		}
+		flock(fd, LOCK_UN);
+	}
+	cache = cf;
+	cachefd = fd;
+}
+
+static struct cacheentry *
+cacheset(const struct cachekey *key)
+{
+	uint64_t h;
+
+	h = fnvhash(key->confighash ^ key->groupshash, key->argv,
+	    key->argvlen);
+	h = fnvhash(h, &key->uid, sizeof(key->uid));
+	h = fnvhash(h, &key->target, sizeof(key->target));
+	return cache->set[h % CACHE_NSETS];
+}
+
+static int
+keymatch(const struct cacheentry *e, const struct cachekey *key)
+{
+	return e->used && e->confighash == key->confighash &&
+	    e->groupshash == key->groupshash && e->uid == key->uid &&
+	    e->target == key->target && e->argvlen == key->argvlen &&
+	    memcmp(e->argv, key->argv, key->argvlen) == 0;
+}
+
+static struct cacheentry *
+findentry(const struct cachekey *key)
+{
+	struct cacheentry *set = cacheset(key);
+	int i;
+
+	for (i = 0; i < CACHE_WAYS; i++)
+		if (keymatch(&set[i], key))
+			return &set[i];
+	return NULL;
+}
+
+static void
+lock(void)
+{
+	sharedlock(cachefd);
+}
+
+static void
+unlock(void)
+{
+	flock(cachefd, LOCK_UN);
+}
+
+/*
+ * Returns PERMIT or DENY with the index and line of the deciding rule,
+ * or 0 if the request is not cached.
+ */
+int
+cache_lookup(const struct cachekey *key, int *rule, int *lineno)
+{
+	struct cacheentry *e;
+	time_t now = time(NULL);
+	int result = 0;
+
+	if (!cache)
+		return 0;
+	lock();
+	if ((e = findentry(key)) && now - e->created < CACHE_TTL) {
+		e->used = now;
+		result = e->result;
+		*rule = e->rule;
+		*lineno = e->lineno;
+	}
+	unlock();
+	return result;
+}
+
+void
+cache_store(const struct cachekey *key, int result, int rule, int lineno)
+{
+	struct cacheentry *set, *e, old;
+	time_t now = time(NULL);
+	int i;
+
+	if (!cache)
+		return;
+	old.used = 0;
+	old.suppressed = 0;
+	lock();
+	if (!(e = findentry(key))) {
+		set = cacheset(key);
+		for (e = &set[0], i = 1; i < CACHE_WAYS; i++)
+			if (set[i].used < e->used)
+				e = &set[i];
+		old = *e;
+		memset(e, 0, sizeof(*e));
+		e->confighash = key->confighash;
+		e->groupshash = key->groupshash;
+		e->uid = key->uid;
+		e->target = key->target;
+		e->argvlen = key->argvlen;
+		memcpy(e->argv, key->argv, key->argvlen);
+	}
+	e->created = e->used = now;
+	e->result = result;
+	e->rule = rule;
+	e->lineno = lineno;
+	unlock();
+
+	/* don't lose count of denials evicted before being logged */
+	if (old.used && old.suppressed) {
+		for (i = 0; i + 1 < (int)old.argvlen; i++)
+			if (old.argv[i] == '\0')
+				old.argv[i] = ' ';
+		syslog(LOG_AUTHPRIV | LOG_NOTICE,
+		    "%u more failed commands for uid %u: %.*s",
+		    old.suppressed, old.uid, (int)old.argvlen, old.argv);
+	}
+}
+
+/*
+ * Rate limit the logging of a denied request.  Returns -1 if it should
+ * not be logged, otherwise the number of identical denials not logged
+ * since the last time.
+ */
+int
+cache_denied(const struct cachekey *key)
+{
+	struct cacheentry *e;
+	time_t now = time(NULL);
+	int n = 0;
+
+	if (!cache)
+		return 0;
+	lock();
+	if ((e = findentry(key))) {
+		if (e->lastlog && now - e->lastlog < DENYLOG_INTERVAL) {
+			e->suppressed++;
+			n = -1;
+		} else {
+			n = e->suppressed;
+			e->suppressed = 0;
+			e->lastlog = now;
+		}
+	}
+	unlock();
+	return n;
+}
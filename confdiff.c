@@ -0,0 +1,470 @@
+/*
+ * Copyright (c) 2016 Nathan Holstein <nathan.holstein@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+
+#include <err.h>
+#include <errno.h>
+#include <grp.h>
+#include <limits.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "openbsd.h"
+
+#include "policy.h"
+#include "doas.h"
+
+/*
+ * Compare the decisions of two configs over every query either of them
+ * could tell apart: each identity, target and command mentioned in a
+ * rule, plus the target and command given on the command line.  The
+ * queries are evaluated by a pool of worker threads.
+ */
+
+#define MAXTHREADS	16
+#define CHUNK		256
+
+struct caller {
+	const char *name;
+	uid_t uid;
+	gid_t groups[NGROUPS_MAX + 1];
+	int ngroups;
+};
+
+struct target {
+	const char *name;
+	uid_t uid;
+};
+
+struct command {
+	const char *cmd;
+	const char **args;
+};
+
+struct difference {
+	size_t query;
+	const struct rule *oldr, *newr;
+};
+
+struct diffctx {
+	const struct policy *oldpol, *newpol;
+	struct caller *callers;
+	struct target *targets;
+	struct command *commands;
+	size_t ncallers, ntargets, ncommands;
+	size_t nqueries;
+	atomic_size_t next;
+};
+
+struct worker {
+	pthread_t thread;
+	struct diffctx *ctx;
+	struct difference *diffs;
+	size_t ndiffs, maxdiffs;
+};
+
+static const char *noargs[] = { NULL };
+
+static void *
+xreallocarray(void *p, size_t nmemb, size_t size)
+{
+	if (!(p = reallocarray(p, nmemb, size)))
+		err(1, "reallocarray");
+	return p;
+}
+
+static int
+commandcmp(const void *a, const void *b)
+{
+	const struct command *ca = a, *cb = b;
+	int i, r;
+
+	if ((r = strcmp(ca->cmd, cb->cmd)) != 0)
+		return r;
+	for (i = 0; ca->args[i] && cb->args[i]; i++)
+		if ((r = strcmp(ca->args[i], cb->args[i])) != 0)
+			return r;
+	return (ca->args[i] != NULL) - (cb->args[i] != NULL);
+}
+
+static int
+differencecmp(const void *a, const void *b)
+{
+	const struct difference *da = a, *db = b;
+
+	return (da->query > db->query) - (da->query < db->query);
+}
+
+/* Sort and remove duplicates; returns the new element count. */
+static size_t
+uniq(void *base, size_t n, size_t size, int (*cmp)(const void *, const void *))
+{
+	char *p = base;
+	size_t i, j;
+
+	if (n == 0)
+		return 0;
+	qsort(base, n, size, cmp);
+	for (i = 0, j = 1; j < n; j++) {
+		if (cmp(p + i * size, p + j * size) != 0 && ++i != j)
+			memcpy(p + i * size, p + j * size, size);
+	}
+	return i + 1;
+}
+
+static int
+decision(const struct rule *r)
+{
+	if (!r || r->action != PERMIT)
+		return 0;
+	return (r->options & NOPASS) ? 2 : 1;
+}
+
+static void
+printdecision(const struct rule *r)
+{
+	static const char *names[] = { "deny", "permit", "permit nopass" };
+
+	printf("%s", names[decision(r)]);
+	if (r)
+		printf(" (line %d)", r->lineno);
+}
+
+static const char **
+collectnames(const struct policy *oldpol, const struct policy *newpol,
+    int target, size_t *np)
+{
+	const struct policy *pols[] = { oldpol, newpol };
+	const char **names = NULL;
+	size_t n = 0;
+	int p, i, j;
+
+	for (p = 0; p < 2; p++) {
+		for (i = 0; i < pols[p]->nrules; i++) {
+			const struct rule *r = pols[p]->rules[i];
+			const struct nameset *set = target ? &r->target :
+			    &r->ident;
+			for (j = 0; j < set->nnames; j++) {
+				names = xreallocarray(names, n + 1,
+				    sizeof(*names));
+				names[n++] = set->names[j];
+			}
+		}
+	}
+	*np = uniq(names, n, sizeof(*names), strpcmp);
+	return names;
+}
+
+static void
+addcommand(struct command **commands, size_t *n, const char *cmd,
+    const char **args)
+{
+	*commands = xreallocarray(*commands, *n + 1, sizeof(**commands));
+	(*commands)[*n].cmd = cmd;
+	(*commands)[*n].args = args ? args : noargs;
+	(*n)++;
+}
+
+/*
+ * Identities become callers.  A user is given its primary group and
+ * every group named in the configs that lists it as a member; a group
+ * becomes an anonymous member of just that group.
+ */
+static void
+buildcallers(struct diffctx *ctx)
+{
+	const char **names, **groupnames;
+	struct group **groups;
+	size_t nnames, ngroupnames = 0, i, j;
+	const char *errstr;
+
+	names = collectnames(ctx->oldpol, ctx->newpol, 0, &nnames);
+	groupnames = xreallocarray(NULL, nnames + 1, sizeof(*groupnames));
+	groups = xreallocarray(NULL, nnames + 1, sizeof(*groups));
+	for (i = 0; i < nnames; i++) {
+		struct group *gr;
+		gid_t gid;
+		if (names[i][0] != ':')
+			continue;
+		if (!(gr = getgrnam(names[i] + 1))) {
+			gid = strtonum(names[i] + 1, 0, GID_MAX, &errstr);
+			if (errstr || !(gr = getgrgid(gid)))
+				continue;
+		}
+		groupnames[ngroupnames] = names[i];
+		if (!(groups[ngroupnames] = malloc(sizeof(*gr))))
+			err(1, "malloc");
+		*groups[ngroupnames] = *gr;
+		for (j = 0; gr->gr_mem[j]; j++)
+			;
+		groups[ngroupnames]->gr_mem = xreallocarray(NULL, j + 1,
+		    sizeof(char *));
+		for (j = 0; gr->gr_mem[j]; j++)
+			if (!(groups[ngroupnames]->gr_mem[j] =
+			    strdup(gr->gr_mem[j])))
+				err(1, "strdup");
+		groups[ngroupnames]->gr_mem[j] = NULL;
+		ngroupnames++;
+	}
+
+	ctx->callers = xreallocarray(NULL, nnames, sizeof(*ctx->callers));
+	for (i = 0; i < nnames; i++) {
+		struct caller *c = &ctx->callers[ctx->ncallers];
+		struct passwd *pw;
+		const char *user;
+		uid_t uid;
+
+		c->name = names[i];
+		c->ngroups = 0;
+		if (names[i][0] == ':') {
+			for (j = 0; j < ngroupnames; j++)
+				if (groupnames[j] == names[i])
+					break;
+			if (j == ngroupnames)
+				continue;
+			c->uid = (uid_t)-1;
+			c->groups[c->ngroups++] = groups[j]->gr_gid;
+			ctx->ncallers++;
+			continue;
+		}
+		if ((pw = getpwnam(names[i])) != NULL) {
+			uid = pw->pw_uid;
+		} else {
+			uid = strtonum(names[i], 0, UID_MAX, &errstr);
+			if (errstr)
+				continue;
+			pw = getpwuid(uid);
+		}
+		c->uid = uid;
+		if (!pw) {
+			ctx->ncallers++;
+			continue;
+		}
+		c->groups[c->ngroups++] = pw->pw_gid;
+		user = pw->pw_name;
+		for (j = 0; j < ngroupnames && c->ngroups <= NGROUPS_MAX; j++) {
+			char **m;
+			for (m = groups[j]->gr_mem; *m; m++) {
+				if (strcmp(*m, user) == 0) {
+					c->groups[c->ngroups++] =
+					    groups[j]->gr_gid;
+					break;
+				}
+			}
+		}
+		ctx->ncallers++;
+	}
+	free(names);
+}
+
+static void
+buildtargets(struct diffctx *ctx, uid_t target)
+{
+	struct passwd *pw;
+	const char **names;
+	size_t nnames, i, j;
+	const char *errstr;
+
+	names = collectnames(ctx->oldpol, ctx->newpol, 1, &nnames);
+	ctx->targets = xreallocarray(NULL, nnames + 1, sizeof(*ctx->targets));
+	ctx->targets[0].name = NULL;
+	ctx->targets[0].uid = target;
+	if ((pw = getpwuid(target)) && !(ctx->targets[0].name =
+	    strdup(pw->pw_name)))
+		err(1, "strdup");
+	ctx->ntargets = 1;
+	for (i = 0; i < nnames; i++) {
+		uid_t uid;
+
+		if ((pw = getpwnam(names[i])) != NULL)
+			uid = pw->pw_uid;
+		else {
+			uid = strtonum(names[i], 0, UID_MAX, &errstr);
+			if (errstr)
+				continue;
+		}
+		for (j = 0; j < ctx->ntargets; j++)
+			if (ctx->targets[j].uid == uid)
+				break;
+		if (j < ctx->ntargets)
+			continue;
+		ctx->targets[ctx->ntargets].name = names[i];
+		ctx->targets[ctx->ntargets].uid = uid;
+		ctx->ntargets++;
+	}
+	free(names);
+}
+
+/*
+ * Every command is tried with the arguments given in the rule and
+ * with none at all; an empty command stands for anything not named.
+ */
+static void
+buildcommands(struct diffctx *ctx, const char *cmd, const char **cmdargs)
+{
+	const struct policy *pols[] = { ctx->oldpol, ctx->newpol };
+	int p, i, j;
+
+	addcommand(&ctx->commands, &ctx->ncommands, "", NULL);
+	if (cmd)
+		addcommand(&ctx->commands, &ctx->ncommands, cmd, cmdargs);
+	for (p = 0; p < 2; p++) {
+		for (i = 0; i < pols[p]->nrules; i++) {
+			const struct rule *r = pols[p]->rules[i];
+			for (j = 0; j < r->cmd.nnames; j++) {
+				const char *c = r->cmd.names[j];
+				addcommand(&ctx->commands, &ctx->ncommands, c,
+				    NULL);
+				if (r->cmdargs)
+					addcommand(&ctx->commands,
+					    &ctx->ncommands, c, r->cmdargs);
+			}
+		}
+	}
+	ctx->ncommands = uniq(ctx->commands, ctx->ncommands,
+	    sizeof(*ctx->commands), commandcmp);
+}
+
+static void *
+diffworker(void *arg)
+{
+	struct worker *w = arg;
+	struct diffctx *ctx = w->ctx;
+	size_t q, end;
+
+	while ((q = atomic_fetch_add(&ctx->next, CHUNK)) < ctx->nqueries) {
+		end = q + CHUNK < ctx->nqueries ? q + CHUNK : ctx->nqueries;
+		for (; q < end; q++) {
+			struct caller *c;
+			struct target *t;
+			struct command *k;
+			const struct rule *oldr, *newr;
+			size_t rest = q;
+
+			k = &ctx->commands[rest % ctx->ncommands];
+			rest /= ctx->ncommands;
+			t = &ctx->targets[rest % ctx->ntargets];
+			c = &ctx->callers[rest / ctx->ntargets];
+
+			policy_permit(ctx->oldpol, c->uid, c->groups, c->ngroups,
+			    &oldr, t->uid, k->cmd, k->args);
+			policy_permit(ctx->newpol, c->uid, c->groups, c->ngroups,
+			    &newr, t->uid, k->cmd, k->args);
+			if (decision(oldr) == decision(newr))
+				continue;
+			if (w->ndiffs == w->maxdiffs) {
+				w->maxdiffs = w->maxdiffs ? w->maxdiffs * 2 : 64;
+				w->diffs = xreallocarray(w->diffs, w->maxdiffs,
+				    sizeof(*w->diffs));
+			}
+			w->diffs[w->ndiffs].query = q;
+			w->diffs[w->ndiffs].oldr = oldr;
+			w->diffs[w->ndiffs].newr = newr;
+			w->ndiffs++;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Print every query whose decision differs between oldpol and newpol.
+ * Returns non-zero if any decision changed.
+ */
+int
+diffconfig(const struct policy *oldpol, const struct policy *newpol,
+    uid_t target, const char *cmd, const char **cmdargs)
+{
+	struct diffctx ctx;
+	struct worker workers[MAXTHREADS];
+	struct difference *diffs = NULL;
+	size_t ndiffs = 0, i;
+	long nthreads;
+	int t, a;
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.oldpol = oldpol;
+	ctx.newpol = newpol;
+	buildcallers(&ctx);
+	buildtargets(&ctx, target);
+	buildcommands(&ctx, cmd, cmdargs);
+	ctx.nqueries = ctx.ncallers * ctx.ntargets * ctx.ncommands;
+	atomic_init(&ctx.next, 0);
+
+	nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads < 1)
+		nthreads = 1;
+	if (nthreads > MAXTHREADS)
+		nthreads = MAXTHREADS;
+	if ((size_t)nthreads > ctx.nqueries / CHUNK + 1)
+		nthreads = ctx.nqueries / CHUNK + 1;
+
+	memset(workers, 0, sizeof(workers));
+	for (t = 0; t < nthreads; t++) {
+		workers[t].ctx = &ctx;
+		if ((errno = pthread_create(&workers[t].thread, NULL,
+		    diffworker, &workers[t])) != 0)
+			err(1, "pthread_create");
+	}
+	for (t = 0; t < nthreads; t++) {
+		if ((errno = pthread_join(workers[t].thread, NULL)) != 0)
+			err(1, "pthread_join");
+		diffs = xreallocarray(diffs, ndiffs + workers[t].ndiffs + 1,
+		    sizeof(*diffs));
+		memcpy(diffs + ndiffs, workers[t].diffs,
+		    workers[t].ndiffs * sizeof(*diffs));
+		ndiffs += workers[t].ndiffs;
+		free(workers[t].diffs);
+	}
+	qsort(diffs, ndiffs, sizeof(*diffs), differencecmp);
+
+	for (i = 0; i < ndiffs; i++) {
+		size_t rest = diffs[i].query;
+		struct command *k = &ctx.commands[rest % ctx.ncommands];
+		struct target *tg;
+		struct caller *c;
+
+		rest /= ctx.ncommands;
+		tg = &ctx.targets[rest % ctx.ntargets];
+		c = &ctx.callers[rest / ctx.ntargets];
+
+		printf("%s as ", c->name);
+		if (tg->name)
+			printf("%s", tg->name);
+		else
+			printf("%u", (unsigned int)tg->uid);
+		if (k->cmd[0] == '\0')
+			printf(": (any other command)");
+		else {
+			printf(": %s", k->cmd);
+			for (a = 0; k->args[a]; a++)
+				printf(" %s", k->args[a]);
+		}
+		printf(": ");
+		printdecision(diffs[i].oldr);
+		printf(" -> ");
+		printdecision(diffs[i].newr);
+		printf("\n");
+	}
+	free(diffs);
+	return ndiffs != 0;
+}
@@ -16,9 +16,11 @@
  */
 
 #include <sys/types.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 
 #include <limits.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -28,11 +30,16 @@
 #include <grp.h>
 #include <syslog.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <paths.h>
+#include <time.h>
 
 #include "openbsd.h"
 
+#include "policy.h"
 #include "doas.h"
 #include "version.h"
+#include "allocstats.h"
 
 static void __dead
 version(void)
@@ -44,151 +51,117 @@ version(void)
 static void __dead
 usage(void)
 {
-	fprintf(stderr, "usage: doas [-nsv] [-C config] [-u user] command [args]\n");
+	fprintf(stderr, "usage: doas [-lMnSsv] [-C config [-D oldconfig]] "
+	    "[-I config [-T samples]] [-u user] command [args]\n");
 	exit(1);
 }
 
-size_t
-arraylen(const char **arr)
-{
-	size_t cnt = 0;
-
-	if (arr) {
-		while (*arr) {
-			cnt++;
-			arr++;
-		}
-	}
-	return cnt;
-}
-
+/*
+ * FNV-1a hash of the config file contents, used to tell whether
+ * the rule statistics belong to the config currently in use.
+ * Returns -1 if the file can't be read.
+ */
 static int
-parseuid(const char *s, uid_t *uid)
+hashfile(FILE *fp, uint64_t *hash)
 {
-	struct passwd *pw;
-	const char *errstr;
+	uint64_t h = FNV_INIT;
+	char buf[8192];
+	size_t n;
 
-	if ((pw = getpwnam(s)) != NULL) {
-		*uid = pw->pw_uid;
-		return 0;
-	}
-	*uid = strtonum(s, 0, UID_MAX, &errstr);
-	if (errstr)
+	while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+		h = fnvhash(h, buf, n);
+	if (ferror(fp))
 		return -1;
+	rewind(fp);
+	*hash = h;
 	return 0;
 }
 
-static int
-uidcheck(const char *s, uid_t desired)
+static uint64_t
+hashconfig(FILE *fp)
 {
-	uid_t uid;
+	uint64_t h;
 
-	if (parseuid(s, &uid) != 0)
-		return -1;
-	if (uid != desired)
-		return -1;
-	return 0;
+	if (hashfile(fp, &h) == -1)
+		err(1, "could not read config file");
+	return h;
 }
 
-static int
-parsegid(const char *s, gid_t *gid)
+static FILE *
+openconfig(const char *filename, int checkperms, uint64_t *hash)
 {
-	struct group *gr;
-	const char *errstr;
+	struct stat sb;
+	FILE *fp;
 
-	if ((gr = getgrnam(s)) != NULL) {
-		*gid = gr->gr_gid;
-		return 0;
+	fp = fopen(filename, "r");
+	if (!fp) {
+		warn("could not open config file");
+		exit(1);
 	}
-	*gid = strtonum(s, 0, GID_MAX, &errstr);
-	if (errstr)
-		return -1;
-	return 0;
+
+	if (checkperms) {
+		if (fstat(fileno(fp), &sb) != 0)
+			err(1, "fstat(\"%s\")", filename);
+		if ((sb.st_mode & (S_IWGRP|S_IWOTH)) != 0)
+			errx(1, "%s is writable by group or other", filename);
+		if (sb.st_uid != 0)
+			errx(1, "%s is not owned by root", filename);
+	}
+
+	*hash = hashconfig(fp);
+	return fp;
 }
 
-static int
-match(uid_t uid, gid_t *groups, int ngroups, uid_t target, const char *cmd,
-    const char **cmdargs, struct rule *r)
+static struct policy *
+loadconfig(FILE *fp)
 {
-	int i;
-
-	if (r->ident[0] == ':') {
-		gid_t rgid;
-		if (parsegid(r->ident + 1, &rgid) == -1)
-			return 0;
-		for (i = 0; i < ngroups; i++) {
-			if (rgid == groups[i])
-				break;
-		}
-		if (i == ngroups)
-			return 0;
-	} else {
-		if (uidcheck(r->ident, uid) != 0)
-			return 0;
-	}
-	if (r->target && uidcheck(r->target, target) != 0)
-		return 0;
-	if (r->cmd) {
-		if (strcmp(r->cmd, cmd))
-			return 0;
-		if (r->cmdargs) {
-			/* if arguments were given, they should match explicitly */
-			for (i = 0; r->cmdargs[i]; i++) {
-				if (!cmdargs[i])
-					return 0;
-				if (strcmp(r->cmdargs[i], cmdargs[i]))
-					return 0;
-			}
-			if (cmdargs[i])
-				return 0;
-		}
+	struct policy *pol;
+
+	if (!(pol = policy_parse(fp)))
+		err(1, "can't allocate policy");
+	fclose(fp);
+	if (pol->nerrors) {
+		if (pol->errors)
+			fputs(pol->errors, stderr);
+		exit(1);
 	}
-	return 1;
+	return pol;
+}
+
+static struct policy *
+parseconfig(const char *filename, int checkperms, uint64_t *hash)
+{
+	return loadconfig(openconfig(filename, checkperms, hash));
 }
 
 static int
-permit(uid_t uid, gid_t *groups, int ngroups, struct rule **lastr,
-    uid_t target, const char *cmd, const char **cmdargs)
+rulenum(const struct policy *pol, const struct rule *rule)
 {
 	int i;
 
-	*lastr = NULL;
-	for (i = 0; i < nrules; i++) {
-		if (match(uid, groups, ngroups, target, cmd,
-		    cmdargs, rules[i]))
-			*lastr = rules[i];
-	}
-	if (!*lastr)
-		return 0;
-	return (*lastr)->action == PERMIT;
+	for (i = 0; rule && i < pol->nrules; i++)
+		if (pol->rules[i] == rule)
+			return i;
+	return -1;
 }
 
+/*
+ * Log a denied command, unless the same request was logged recently; the
+ * next message logged then counts the ones left out.
+ */
 static void
-parseconfig(const char *filename, int checkperms)
+logdenied(const struct cachekey *key, const char *myname,
+    const char *cmdline)
 {
-	extern FILE *yyfp;
-	extern int yyparse(void);
-	struct stat sb;
-
-	yyfp = fopen(filename, "r");
-	if (!yyfp) {
-		warn("could not open config file");
-		exit(1);
-	}
-
-	if (checkperms) {
-		if (fstat(fileno(yyfp), &sb) != 0)
-			err(1, "fstat(\"%s\")", filename);
-		if ((sb.st_mode & (S_IWGRP|S_IWOTH)) != 0)
-			errx(1, "%s is writable by group or other", filename);
-		if (sb.st_uid != 0)
-			errx(1, "%s is not owned by root", filename);
-	}
+	int n = key ? cache_denied(key) : 0;
 
-	yyparse();
-	fclose(yyfp);
-	if (parse_errors)
-		exit(1);
+	if (n > 0)
+		syslog(LOG_AUTHPRIV | LOG_NOTICE,
+		    "failed command for %s: %s (%d more not logged)",
+		    myname, cmdline, n);
+	else if (n == 0)
+		syslog(LOG_AUTHPRIV | LOG_NOTICE,
+		    "failed command for %s: %s", myname, cmdline);
 }
 
 /*
@@ -217,7 +190,7 @@ copyenvhelper(const char **oldenvp, const char **safeset, size_t nsafe,
 }
 
 static char **
-copyenv(const char **oldenvp, struct rule *rule)
+copyenv(const char **oldenvp, const struct rule *rule)
 {
 	const char *safeset[] = {
 		"DISPLAY", "HOME", "LOGNAME", "MAIL",
@@ -229,7 +202,7 @@ copyenv(const char **oldenvp, struct rule *rule)
 		NULL
 	};
 	char **envp;
-	const char **extra;
+	const char **extra = NULL;
 	int ei;
 	size_t nsafe, nbad;
 	size_t nextras = 0;
@@ -262,9 +235,14 @@ copyenv(const char **oldenvp, struct rule *rule)
 	}
 
 	nsafe = arraylen(safeset);
-	if ((extra = rule->envlist)) {
+	if (rule->envlist) {
 		size_t isafe;
-		nextras = arraylen(extra);
+		nextras = arraylen(rule->envlist);
+		/* the rule belongs to the policy; filter a private copy */
+		extra = reallocarray(NULL, nextras + 1, sizeof(*extra));
+		if (!extra)
+			err(1, "reallocarray");
+		memcpy(extra, rule->envlist, (nextras + 1) * sizeof(*extra));
 		for (isafe = 0; isafe < nsafe; isafe++) {
 			size_t iextras;
 			for (iextras = 0; iextras < nextras; iextras++) {
@@ -284,12 +262,114 @@ copyenv(const char **oldenvp, struct rule *rule)
 
 	ei = 0;
 	ei = copyenvhelper(oldenvp, safeset, nsafe, envp, ei);
-	ei = copyenvhelper(oldenvp, rule->envlist, nextras, envp, ei);
+	ei = copyenvhelper(oldenvp, extra, nextras, envp, ei);
 	envp[ei] = NULL;
 
 	return envp;
 }
 
+/*
+ * Translate the resource settings of a rule into the login class
+ * capabilities setusercontext() applies.
+ */
+static void
+rulecap(const struct resources *res, login_cap_t *lc)
+{
+	int i;
+
+	memset(lc, 0, sizeof(*lc));
+	if (!res)
+		return;
+	if (res->set & RES_NICE) {
+		lc->lcap_set |= LCAP_NICE;
+		lc->lcap_nice = res->nice;
+	}
+	if (res->set & RES_IOCLASS) {
+		lc->lcap_set |= LCAP_IOPRIO;
+		lc->lcap_ioclass = res->ioclass;
+		lc->lcap_iolevel = res->iolevel;
+	}
+	if (res->set & RES_CPUS) {
+		lc->lcap_set |= LCAP_CPUS;
+		memcpy(lc->lcap_cpus, res->cpus, sizeof(lc->lcap_cpus));
+	}
+	if (res->set & RES_CGROUP) {
+		lc->lcap_set |= LCAP_CGROUP;
+		lc->lcap_cgroup = res->cgroup;
+	}
+	for (i = 0; i < res->nrlimits; i++) {
+		lc->lcap_rlimits[i].resource = res->rlimits[i].resource;
+		lc->lcap_rlimits[i].value = res->rlimits[i].value;
+	}
+	lc->lcap_nrlimits = res->nrlimits;
+}
+
+/*
+ * A name not resolved in time makes deny rules using it apply to
+ * everybody, which needs explaining.
+ */
+static void
+logunresolved(const char *name, int group,
+    void *arg __attribute__((unused)))
+{
+	syslog(LOG_AUTHPRIV | LOG_NOTICE, "%s %s in %s not resolved in time, "
+	    "treated as matching in deny rules", group ? "group" : "user",
+	    name, DOAS_CONF);
+}
+
+static void
+printres(const struct resources *res)
+{
+	static const char *ioclasses[] = {
+		NULL, "realtime", "best-effort", "idle"
+	};
+	int i;
+
+	if (!res)
+		return;
+	if (res->set & RES_NICE)
+		printf(" nice %d", res->nice);
+	for (i = 0; i < res->nrlimits; i++) {
+		if (res->rlimits[i].value == RLIM_INFINITY)
+			printf(" rlimit %s infinity", res->rlimits[i].name);
+		else
+			printf(" rlimit %s %llu", res->rlimits[i].name,
+			    (unsigned long long)res->rlimits[i].value);
+	}
+	if (res->set & RES_IOCLASS) {
+		printf(" ioclass %s", ioclasses[res->ioclass]);
+		if (res->ioclass != 3)
+			printf(":%d", res->iolevel);
+	}
+	if (res->set & RES_CPUS)
+		printf(" cpus %s", res->cpulist);
+	if (res->set & RES_CGROUP)
+		printf(" cgroup %s", res->cgroup);
+}
+
+static void
+printgrant(const struct rule *rule, const char *target, const char *cmd,
+    void *arg __attribute__((unused)))
+{
+	int i;
+
+	if (rule->action == PERMIT)
+		printf("permit%s", (rule->options & NOPASS) ? " nopass" : "");
+	else
+		printf("deny");
+	if (target)
+		printf(" as %s", target);
+	if (cmd) {
+		printf(" cmd %s", cmd);
+		if (rule->cmdargs) {
+			printf(" args");
+			for (i = 0; rule->cmdargs[i]; i++)
+				printf(" %s", rule->cmdargs[i]);
+		}
+	}
+	printf("\n");
+}
+
 static void __dead
 fail(void)
 {
@@ -297,20 +377,45 @@ fail(void)
 	exit(1);
 }
 
+static void __dead
+compareconfig(const char *oldpath, const char *newpath, int argc,
+    char **argv, uid_t uid, uid_t target)
+{
+	struct policy *oldpol, *newpol;
+	uint64_t hash;
+
+	setresuid(uid, uid, uid);
+	oldpol = parseconfig(oldpath, 0, &hash);
+	newpol = parseconfig(newpath, 0, &hash);
+	exit(diffconfig(oldpol, newpol, target, argc ? argv[0] : NULL,
+	    (const char **)argv + 1) ? 1 : 0);
+}
+
 static void __dead
 checkconfig(const char *confpath, int argc, char **argv,
     uid_t uid, gid_t *groups, int ngroups, uid_t target)
 {
-	struct rule *rule;
+	struct policy *pol;
+	const struct rule *rule;
+	uint64_t hash;
+	int ok;
 
 	setresuid(uid, uid, uid);
-	parseconfig(confpath, 0);
+	allocstats_phase(ALLOC_PARSE);
+	pol = parseconfig(confpath, 0, &hash);
+	allocstats_phase(ALLOC_OTHER);
 	if (!argc)
 		exit(0);
 
-	if (permit(uid, groups, ngroups, &rule, target, argv[0],
-	    (const char **)argv + 1)) {
-		printf("permit%s\n", (rule->options & NOPASS) ? " nopass" : "");
+	policy_prefetch(pol, PREFETCH_THREADS, PREFETCH_TIMEOUT);
+	allocstats_phase(ALLOC_PERMIT);
+	ok = policy_permit(pol, uid, groups, ngroups, &rule, target, argv[0],
+	    (const char **)argv + 1);
+	allocstats_phase(ALLOC_OTHER);
+	if (ok) {
+		printf("permit%s", (rule->options & NOPASS) ? " nopass" : "");
+		printres(rule->res);
+		printf("\n");
 		exit(0);
 	} else {
 		printf("deny\n");
@@ -318,42 +423,373 @@ checkconfig(const char *confpath, int argc, char **argv,
 	}
 }
 
+/*
+ * Parse a config without exiting on errors, for installconfig().
+ * Returns NULL after printing the errors.
+ */
+static struct policy *
+tryparse(FILE *fp, const char *filename)
+{
+	struct policy *pol;
+
+	if (!(pol = policy_parse(fp))) {
+		warn("can't allocate policy");
+		return NULL;
+	}
+	if (pol->nerrors) {
+		fprintf(stderr, "%s:\n%s", filename,
+		    pol->errors ? pol->errors : "");
+		policy_free(pol);
+		return NULL;
+	}
+	return pol;
+}
+
+/*
+ * Check the decisions of pol against a file of sample requests, one
+ * per line in the form "permit|deny user target command [args]".
+ * Prints each request that is decided otherwise and returns the number
+ * of them, or -1 if the file can't be used.
+ */
+static int
+checksamples(const struct policy *pol, const char *path)
+{
+	char line[LINE_MAX], *fields[64], *p;
+	const char *args[64];
+	const struct rule *rule;
+	struct passwd *pw;
+	gid_t groups[NGROUPS_MAX + 1];
+	uid_t uid, target;
+	FILE *fp;
+	int lineno = 0, nfields, ngroups, expect, ok, bad = 0, i;
+
+	if (!(fp = fopen(path, "r"))) {
+		warn("%s", path);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), fp)) {
+		lineno++;
+		if ((p = strchr(line, '#')))
+			*p = '\0';
+		nfields = 0;
+		for (p = strtok(line, " \t\n"); p; p = strtok(NULL, " \t\n")) {
+			if (nfields == 64) {
+				warnx("%s:%d: too many arguments", path, lineno);
+				fclose(fp);
+				return -1;
+			}
+			fields[nfields++] = p;
+		}
+		if (nfields == 0)
+			continue;
+		expect = strcmp(fields[0], "permit") == 0;
+		if (nfields < 4 || (!expect && strcmp(fields[0], "deny") != 0)) {
+			warnx("%s:%d: syntax error", path, lineno);
+			fclose(fp);
+			return -1;
+		}
+		if (parseuid(fields[1], &uid) != 0 ||
+		    parseuid(fields[2], &target) != 0) {
+			warnx("%s:%d: unknown user", path, lineno);
+			fclose(fp);
+			return -1;
+		}
+		ngroups = 0;
+		if ((pw = getpwuid(uid))) {
+			ngroups = NGROUPS_MAX + 1;
+#ifdef __APPLE__
+			if (getgrouplist(pw->pw_name, (int)pw->pw_gid,
+			    (int *)groups, &ngroups) == -1)
+#else
+			if (getgrouplist(pw->pw_name, pw->pw_gid, groups,
+			    &ngroups) == -1)
+#endif
+				ngroups = 0;
+		}
+		for (i = 4; i < nfields; i++)
+			args[i - 4] = fields[i];
+		args[i - 4] = NULL;
+		ok = policy_permit(pol, uid, groups, ngroups, &rule, target,
+		    fields[3], args);
+		if (ok != expect) {
+			printf("%s:%d: %s, but line %d says %s\n", path,
+			    lineno, fields[0], rule ? rule->lineno : 0,
+			    ok ? "permit" : "deny");
+			bad++;
+		}
+	}
+	if (ferror(fp)) {
+		warn("%s", path);
+		bad = -1;
+	}
+	fclose(fp);
+	return bad;
+}
+
+/*
+ * Install a new /etc/doas.conf.  The candidate is copied next to the
+ * live config and the copy is what gets checked, so the file that goes
+ * live is exactly the one that passed.  The changes in decisions are
+ * listed and the sample requests, if any, are tried.  The identity
+ * snapshot for the new config is built beforehand and put in place just
+ * before the copy is renamed into place.
+ */
+static void __dead
+installconfig(const char *path, const char *samples)
+{
+	char tmp[] = DOAS_CONF ".XXXXXXXXXX";
+	char buf[8192];
+	struct policy *pol, *oldpol = NULL;
+	struct stat sb;
+	uint64_t hash, newhash, oldhash;
+	mode_t mode = S_IRUSR | S_IWUSR;
+	FILE *fp, *out;
+	size_t n;
+	int fd, i, bad;
+
+	fp = openconfig(path, 1, &hash);
+	if (stat(DOAS_CONF, &sb) == 0)
+		mode = sb.st_mode & (S_IRWXU | S_IRGRP | S_IROTH);
+	if ((fd = mkstemp(tmp)) == -1)
+		err(1, "mkstemp");
+	if (fchmod(fd, mode) != 0 || !(out = fdopen(fd, "w+"))) {
+		warn("%s", tmp);
+		goto fail;
+	}
+	while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+		if (fwrite(buf, 1, n, out) != n)
+			break;
+	/* a short write, say on a full disk, must not go live */
+	if (ferror(fp) || ferror(out) || fflush(out) != 0 || fsync(fd) != 0) {
+		warn("can't copy %s", path);
+		goto fail;
+	}
+	fclose(fp);
+	rewind(out);
+	if (hashfile(out, &newhash) == -1) {
+		warn("can't read %s", tmp);
+		goto fail;
+	}
+	if (newhash != hash) {
+		warnx("%s changed while being copied", path);
+		goto fail;
+	}
+	if (!(pol = tryparse(out, path)))
+		goto fail;
+
+	/* a config that permits nothing locks everybody out */
+	for (i = 0; i < pol->nrules; i++)
+		if (pol->rules[i]->action == PERMIT)
+			break;
+	if (i == pol->nrules) {
+		warnx("%s permits nothing", path);
+		goto fail;
+	}
+
+	if ((fp = fopen(DOAS_CONF, "r"))) {
+		if (hashfile(fp, &oldhash) == -1) {
+			warn("%s", DOAS_CONF);
+			fclose(fp);
+			goto fail;
+		}
+		oldpol = tryparse(fp, DOAS_CONF);
+		fclose(fp);
+		if (oldhash == hash) {
+			/* just refresh the snapshot */
+			printf("%s is already installed\n", path);
+			idsnap_stage(pol, hash);
+			idsnap_commit();
+			idsnap_unstage();
+			unlink(tmp);
+			exit(0);
+		}
+	}
+	if (oldpol)
+		diffconfig(oldpol, pol, 0, NULL, NULL);
+	if (samples && (bad = checksamples(pol, samples)) != 0) {
+		if (bad > 0)
+			warnx("%d sample requests decided otherwise", bad);
+		goto fail;
+	}
+
+	if (fclose(out) != 0) {
+		warn("can't copy %s", path);
+		goto fail;
+	}
+	idsnap_stage(pol, hash);
+	idsnap_commit();
+	if (rename(tmp, DOAS_CONF) != 0) {
+		warn("can't install %s", path);
+		goto fail;
+	}
+	idsnap_unstage();
+	if ((fd = open(DOAS_CONFDIR, O_RDONLY)) != -1) {
+		fsync(fd);
+		close(fd);
+	}
+	exit(0);
+
+fail:
+	idsnap_unstage();
+	unlink(tmp);
+	exit(1);
+}
+
+#ifdef MAINSTAMP
+/*
+ * For the startup benchmark in regress: write the time main() was
+ * reached, in nanoseconds, to the descriptor named by DOAS_MAINSTAMP.
+ */
+static void
+mainstamp(void)
+{
+	struct timespec ts;
+	const char *s;
+	int fd;
+
+	if (!(s = getenv("DOAS_MAINSTAMP")) || (fd = atoi(s)) <= STDERR_FILENO)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	dprintf(fd, "%lld\n",
+	    (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec);
+	close(fd);
+}
+#endif
+
+#ifdef NONSS
+static char **origargv, **origenvp;
+
+/*
+ * The static build can't ask PAM for a password or NSS for a name, so
+ * it hands the requests that need them to the regular build, before
+ * anything is logged or counted.
+ */
+static void __dead
+dynamic(void)
+{
+	struct stat sb;
+
+	if (stat(DOAS_DYNAMIC, &sb) != 0)
+		err(1, "%s", DOAS_DYNAMIC);
+	if (sb.st_uid != 0 || (sb.st_mode & (S_IWGRP|S_IWOTH)) != 0)
+		errx(1, "%s is writable by group or other, or not owned by root",
+		    DOAS_DYNAMIC);
+	execve(DOAS_DYNAMIC, origargv, origenvp);
+	err(1, "%s", DOAS_DYNAMIC);
+}
+
+/*
+ * Decide the request from the files alone, and hand it over if the
+ * rule asks for a password or a name or id wasn't found.  What stays
+ * is decided again, and counted, like in the regular build.
+ */
+static struct policy *
+loadstatic(uint64_t *hash, uid_t uid, gid_t *groups, int ngroups,
+    uid_t target, char **argv)
+{
+	struct policy *pol;
+	const struct rule *rule;
+	int ok;
+
+	pol = loadconfig(openconfig(DOAS_CONF, 1, hash));
+	if (idsnap_needsupdate(*hash))
+		dynamic();
+	pol->uidlookup = idsnap_uid;
+	pol->gidlookup = idsnap_gid;
+	if (policy_prefetch(pol, PREFETCH_THREADS, PREFETCH_TIMEOUT) > 0)
+		dynamic();
+	ok = policy_permit(pol, uid, groups, ngroups, &rule, target,
+	    argv[0], (const char **)argv + 1);
+	if (ok && (!(rule->options & NOPASS) || !idsnap_getpwuid(target)))
+		dynamic();
+	if (files_missed())
+		dynamic();
+	return pol;
+}
+#endif
+
 int
 main(int argc, char **argv, char **envp)
 {
 	const char *safepath = "/bin:/sbin:/usr/bin:/usr/sbin:"
 	    "/usr/local/bin:/usr/local/sbin";
 	const char *confpath = NULL;
+	const char *oldconfpath = NULL;
+	const char *installpath = NULL;
+	const char *samplepath = NULL;
 	char *shargv[] = { NULL, NULL };
 	char *sh;
 	const char *cmd;
 	char cmdline[LINE_MAX];
 	char myname[_PW_NAME_LEN + 1];
 	struct passwd *pw;
-	struct rule *rule;
+	struct policy *pol;
+	const struct rule *rule;
+	uint64_t hash;
+	struct cachekey key, *keyp = &key;
+	int cached = 0, ruleidx = -1, lineno = 0, late;
+	FILE *fp;
+	struct timespec start, ts;
+	login_cap_t lc;
 	uid_t uid;
 	uid_t target = 0;
-	gid_t groups[NGROUPS_MAX + 1];
-	int ngroups;
-	int i, ch;
+	gid_t groups[NGROUPS_MAX + 1], tgroups[NGROUPS_MAX + 1];
+	int ngroups, ntgroups;
+	int i, ch, ok;
+	int lflag = 0;
+	int Mflag = 0;
+	int Sflag = 0;
 	int sflag = 0;
 	int nflag = 0;
 	int vflag = 0;
 
+#ifdef MAINSTAMP
+	mainstamp();
+#endif
+	metrics_start(&start);
 	uid = getuid();
-
-	while ((ch = getopt(argc, argv, "C:nsu:v")) != -1) {
+#ifdef NONSS
+	/* getopt() reorders argv */
+	if (!(origargv = reallocarray(NULL, argc + 1, sizeof(*origargv))))
+		err(1, NULL);
+	memcpy(origargv, argv, (argc + 1) * sizeof(*origargv));
+	origenvp = envp;
+#endif
+
+	while ((ch = getopt(argc, argv, "C:D:I:lMnSsT:u:v")) != -1) {
 		switch (ch) {
 		case 'C':
 			confpath = optarg;
 			break;
+		case 'D':
+			oldconfpath = optarg;
+			break;
+		case 'I':
+			installpath = optarg;
+			break;
+		case 'T':
+			samplepath = optarg;
+			break;
 		case 'u':
-			if (parseuid(optarg, &target) != 0)
+			if (parseuid(optarg, &target) != 0) {
+#ifdef NONSS
+				dynamic();
+#endif
 				errx(1, "unknown user");
+			}
+			break;
+		case 'l':
+			lflag = 1;
+			break;
+		case 'M':
+			Mflag = 1;
 			break;
 		case 'n':
 			nflag = 1;
 			break;
+		case 'S':
+			Sflag = 1;
+			break;
 		case 's':
 			sflag = 1;
 			break;
@@ -371,13 +807,57 @@ main(int argc, char **argv, char **envp)
 	if (vflag)
 		version();
 
-	if (confpath) {
+	if ((oldconfpath && !confpath) || (samplepath && !installpath))
+		usage();
+
+	if (Sflag) {
+		if (confpath || sflag || argc)
+			usage();
+		if (uid != 0)
+			errx(1, "rule statistics are only available to root");
+		stats_report();
+	}
+
+	if (Mflag) {
+		if (confpath || sflag || argc)
+			usage();
+		if (uid != 0)
+			errx(1, "metrics are only available to root");
+		metrics_report();
+	}
+
+	if (installpath) {
+		if (confpath || lflag || sflag || argc)
+			usage();
+		if (uid != 0)
+			errx(1, "only root may install a config");
+#ifdef NONSS
+		dynamic();
+#endif
+		idsnap_open();
+		installconfig(installpath, samplepath);
+	}
+
+	if (lflag) {
+		if (confpath || sflag || argc)
+			usage();
+	} else if (confpath) {
 		if (sflag)
 			usage();
 	} else if ((!sflag && !argc) || (sflag && argc))
 		usage();
-
-	pw = getpwuid(uid);
+#ifdef NONSS
+	/* listing and checking rules don't need a fast path */
+	if (lflag || confpath)
+		dynamic();
+#endif
+
+	idsnap_open();
+	pw = idsnap_getpwuid(uid);
+#ifdef NONSS
+	if (!pw)
+		dynamic();
+#endif
 	if (!pw)
 		err(1, "getpwuid failed");
 	if (strlcpy(myname, pw->pw_name, sizeof(myname)) >= sizeof(myname))
@@ -397,16 +877,19 @@ main(int argc, char **argv, char **envp)
 		argc = 1;
 	}
 
+	if (oldconfpath) {
+		compareconfig(oldconfpath, confpath, argc, argv, uid, target);
+		exit(1);	/* fail safe */
+	}
+
 	if (confpath) {
 		checkconfig(confpath, argc, argv, uid, groups, ngroups,
 		    target);
 		exit(1);	/* fail safe */
 	}
 
-	parseconfig("/etc/doas.conf", 1);
-
 	/* cmdline is used only for logging, no need to abort on truncate */
-	(void) strlcpy(cmdline, argv[0], sizeof(cmdline));
+	(void) strlcpy(cmdline, argc ? argv[0] : "", sizeof(cmdline));
 	for (i = 1; i < argc; i++) {
 		if (strlcat(cmdline, " ", sizeof(cmdline)) >= sizeof(cmdline))
 			break;
@@ -414,37 +897,122 @@ main(int argc, char **argv, char **envp)
 			break;
 	}
 
+	pol = NULL;
+#ifdef NONSS
+	pol = loadstatic(&hash, uid, groups, ngroups, target, argv);
+#endif
+	metrics_open();
+	fp = pol ? NULL : openconfig(DOAS_CONF, 1, &hash);
+	stats_open(hash);
+
+	/* a request denied recently is turned away before parsing */
+	if (!lflag && cache_key(&key, hash, uid, groups, ngroups, target,
+	    argv) == 0) {
+		cache_open();
+		cached = cache_lookup(&key, &ruleidx, &lineno);
+		if (cached == DENY) {
+			stats_countline(lineno, STAT_DENY);
+			metrics_count(METRIC_DENIES);
+			logdenied(&key, myname, cmdline);
+			fail();
+		}
+	} else
+		keyp = NULL;
+
+	if (!pol) {
+		metrics_start(&ts);
+		allocstats_phase(ALLOC_PARSE);
+		pol = loadconfig(fp);
+		allocstats_phase(ALLOC_OTHER);
+		metrics_time(LATENCY_PARSE, &ts);
+	}
+	pol->matched = stats_match;
+	pol->uidlookup = idsnap_uid;
+	pol->gidlookup = idsnap_gid;
+	if (idsnap_needsupdate(hash)) {
+		const char *extra[] = { myname, NULL };
+		idsnap_update(pol, hash, extra);
+	}
+
+	if (lflag) {
+		policy_prefetch(pol, PREFETCH_THREADS, PREFETCH_TIMEOUT);
+		if (policy_list(pol, uid, groups, ngroups, printgrant,
+		    NULL) == -1)
+			err(1, "can't list rules");
+		exit(0);
+	}
+
 	cmd = argv[0];
-	if (!permit(uid, groups, ngroups, &rule, target, cmd,
-	    (const char**)argv + 1)) {
-		syslog(LOG_AUTHPRIV | LOG_NOTICE,
-		    "failed command for %s: %s", myname, cmdline);
+	metrics_start(&ts);
+	if (cached == PERMIT && ruleidx >= 0 && ruleidx < pol->nrules) {
+		rule = pol->rules[ruleidx];
+		ok = 1;
+	} else {
+		late = policy_prefetch(pol, PREFETCH_THREADS,
+		    PREFETCH_TIMEOUT);
+		if (late > 0)
+			policy_unresolved(pol, logunresolved, NULL);
+		allocstats_phase(ALLOC_PERMIT);
+		ok = policy_permit(pol, uid, groups, ngroups, &rule, target,
+		    cmd, (const char**)argv + 1);
+		allocstats_phase(ALLOC_OTHER);
+		/* don't remember a decision made without all the names */
+		if (keyp && late <= 0)
+			cache_store(keyp, ok ? PERMIT : DENY, rulenum(pol, rule),
+			    rule ? rule->lineno : 0);
+	}
+	metrics_time(LATENCY_PERMIT, &ts);
+	if (!ok) {
+		if (rule)
+			stats_count(rule, STAT_DENY);
+		metrics_count(METRIC_DENIES);
+		logdenied(keyp, myname, cmdline);
 		fail();
 	}
+	stats_count(rule, STAT_PERMIT);
+	metrics_count(METRIC_PERMITS);
 
 	if (!(rule->options & NOPASS)) {
 		if (nflag)
 			errx(1, "Authorization required");
-		if (!auth_userokay(myname, NULL, NULL, NULL)) {
+		metrics_start(&ts);
+		ok = auth_userokay(myname, NULL, NULL, NULL);
+		metrics_time(LATENCY_AUTH, &ts);
+		if (!ok) {
+			stats_count(rule, STAT_AUTHFAIL);
+			metrics_count(METRIC_AUTHFAILS);
 			syslog(LOG_AUTHPRIV | LOG_NOTICE,
 			    "failed password for %s", myname);
 			fail();
 		}
 	}
+	allocstats_phase(ALLOC_ENV);
 	envp = copyenv((const char **)envp, rule);
+	allocstats_phase(ALLOC_OTHER);
 
-	pw = getpwuid(target);
+	pw = idsnap_getpwuid(target);
 	if (!pw)
 		errx(1, "no passwd entry for target");
-	if (setusercontext(NULL, pw, target, LOGIN_SETGROUP |
+	rulecap(rule->res, &lc);
+	ntgroups = NGROUPS_MAX + 1;
+	if (idsnap_groups(target, tgroups, &ntgroups) == 0) {
+		lc.lcap_set |= LCAP_GROUPS;
+		lc.lcap_groups = tgroups;
+		lc.lcap_ngroups = ntgroups;
+	}
+	metrics_start(&ts);
+	if (setusercontext(&lc, pw, target, LOGIN_SETGROUP |
 	    LOGIN_SETPRIORITY | LOGIN_SETRESOURCES | LOGIN_SETUMASK |
 	    LOGIN_SETUSER) != 0)
 		errx(1, "failed to set user context for target");
+	metrics_time(LATENCY_USERCONTEXT, &ts);
 
 	syslog(LOG_AUTHPRIV | LOG_INFO, "%s ran command as %s: %s",
 	    myname, pw->pw_name, cmdline);
 	if (setenv("PATH", safepath, 1) == -1)
 		err(1, "failed to set PATH '%s'", safepath);
+	metrics_time(LATENCY_PREEXEC, &start);
+	allocstats_report();
 	execvpe(cmd, argv, envp);
 	if (errno == ENOENT)
 		errx(1, "%s: command not found", cmd);
@@ -1,23 +1,83 @@
 /* $OpenBSD: doas.h,v 1.3 2015/07/21 11:04:06 zhuk Exp $ */
 
-struct rule {
-	int action;
-	int options;
-	const char *ident;
-	const char *target;
-	const char *cmd;
-	const char **cmdargs;
-	const char **envlist;
+int diffconfig(const struct policy *, const struct policy *, uid_t,
+    const char *, const char **);
+
+/*
+ * Where doas keeps its files.  The regress tests build doas with
+ * PATH_ROOT set to a scratch directory.
+ */
+#ifndef PATH_ROOT
+#define PATH_ROOT	""
+#endif
+#define DOAS_CONFDIR	PATH_ROOT "/etc"
+#define DOAS_CONF	DOAS_CONFDIR "/doas.conf"
+#define DOAS_RUNDIR	PATH_ROOT _PATH_VARRUN
+
+int sharedlock(int);
+void *mapshared(const char *, size_t, mode_t, int *);
+
+void stats_open(uint64_t);
+void stats_count(const struct rule *, int);
+void stats_countline(int, int);
+void stats_match(const struct rule *);
+void __dead stats_report(void);
+
+void idsnap_open(void);
+int idsnap_needsupdate(uint64_t);
+void idsnap_update(const struct policy *, uint64_t, const char **);
+void idsnap_stage(const struct policy *, uint64_t);
+void idsnap_commit(void);
+void idsnap_unstage(void);
+int idsnap_uid(const char *, uid_t *);
+int idsnap_gid(const char *, gid_t *);
+struct passwd *idsnap_getpwuid(uid_t);
+int idsnap_groups(uid_t, gid_t *, int *);
+
+#define CACHE_MAXARGV	512
+
+struct cachekey {
+	uint64_t confighash;
+	uint64_t groupshash;
+	uid_t uid;
+	uid_t target;
+	size_t argvlen;
+	char argv[CACHE_MAXARGV];	/* NUL separated */
 };
 
-extern struct rule **rules;
-extern int nrules, maxrules;
-extern int parse_errors;
+int cache_key(struct cachekey *, uint64_t, uid_t, const gid_t *, int, uid_t,
+    char **);
+void cache_open(void);
+int cache_lookup(const struct cachekey *, int *, int *);
+void cache_store(const struct cachekey *, int, int, int);
+int cache_denied(const struct cachekey *);
+
+void metrics_open(void);
+void metrics_count(int);
+void metrics_start(struct timespec *);
+void metrics_time(int, const struct timespec *);
+void __dead metrics_report(void);
+
+/* resolving the names in the config, see policy_prefetch() */
+#define PREFETCH_THREADS	8
+#define PREFETCH_TIMEOUT	2000	/* milliseconds */
 
-size_t arraylen(const char **);
+#define STAT_MATCH	0
+#define STAT_PERMIT	1
+#define STAT_DENY	2
+#define STAT_AUTHFAIL	3
+#define STAT_NCOUNTERS	4
 
-#define PERMIT	1
-#define DENY	2
+#define METRIC_INVOCATIONS	0
+#define METRIC_PERMITS		1
+#define METRIC_DENIES		2
+#define METRIC_AUTHFAILS	3
+#define METRIC_NCOUNTERS	4
 
-#define NOPASS		0x1
-#define KEEPENV		0x2
+#define LATENCY_PARSE		0
+#define LATENCY_PERMIT		1
+#define LATENCY_AUTH		2
+#define LATENCY_USERCONTEXT	3
+#define LATENCY_PREEXEC		4
+#define LATENCY_LOCKWAIT	5
+#define LATENCY_NHISTS		6
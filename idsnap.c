@@ -0,0 +1,611 @@
+/*
+ * Copyright (c) 2016 Nathan Holstein <nathan.holstein@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <limits.h>
+#include <paths.h>
+#include <pwd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "openbsd.h"
+
+#include "policy.h"
+#include "doas.h"
+
+/*
+ * The identity snapshot holds the passwd entries and group lists of
+ * every user, and the gids of every group, named in /etc/doas.conf,
+ * so that the common case needs no trip through NSS.  doas only uses
+ * it if an administrator has created the file; doas rewrites it once
+ * it is older than IDSNAP_TTL or the config has changed.  Only one
+ * process rewrites it at a time; the others go on using the old one
+ * for up to IDSNAP_GRACE more seconds.  Anything missing from the
+ * snapshot is looked up in the system databases.
+ *
+ * Such a rewrite happens in some user's invocation, so it only looks up
+ * the names in the rules and the calling user.  The members of the
+ * groups in the rules, which can be many in a directory, are only added
+ * when root refreshes the snapshot with doas -I.
+ *
+ * The file consists of the header, the users sorted by name, an index
+ * of the users sorted by uid, the groups sorted by name, a table of
+ * supplementary gids and the strings, each NUL terminated.
+ */
+
+#define IDSNAP_FILE	DOAS_RUNDIR "doas.ids"
+#define IDSNAP_MAGIC	0x646f6964	/* "doid" */
+#define IDSNAP_VERSION	1
+#define IDSNAP_LOCK	IDSNAP_FILE ".lock"
+#define IDSNAP_TTL	600
+#define IDSNAP_GRACE	600
+
+struct idsnaphdr {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t confighash;
+	int64_t created;
+	uint32_t nusers;
+	uint32_t ngroups;
+	uint32_t ngids;
+	uint32_t strsize;
+};
+
+struct idsnapuser {
+	uint32_t name;
+	uint32_t dir;
+	uint32_t shell;
+	uint32_t uid;
+	uint32_t gid;
+	uint32_t groups;
+	uint32_t ngroups;
+};
+
+struct idsnapgroup {
+	uint32_t name;
+	uint32_t gid;
+};
+
+static int enabled, needupdate;
+static const struct idsnaphdr *snap;
+static const struct idsnapuser *users;
+static const uint32_t *byuid;
+static const struct idsnapgroup *groups;
+static const uint32_t *gids;
+static const char *strings;
+
+static size_t
+snapsize(const struct idsnaphdr *h)
+{
+	return sizeof(*h) + h->nusers * sizeof(*users) +
+	    h->nusers * sizeof(*byuid) + h->ngroups * sizeof(*groups) +
+	    h->ngids * sizeof(*gids) + h->strsize;
+}
+
+static int
+validstr(uint32_t off)
+{
+	return off < snap->strsize;
+}
+
+static int
+snapvalid(size_t size)
+{
+	uint32_t i;
+
+	if (snap->magic != IDSNAP_MAGIC || snap->version != IDSNAP_VERSION ||
+	    snap->nusers > INT32_MAX / sizeof(*users) ||
+	    snap->ngroups > INT32_MAX / sizeof(*groups) ||
+	    snap->ngids > INT32_MAX / sizeof(*gids) ||
+	    snap->strsize > INT32_MAX || snapsize(snap) != size)
+		return 0;
+
+	users = (const struct idsnapuser *)(snap + 1);
+	byuid = (const uint32_t *)(users + snap->nusers);
+	groups = (const struct idsnapgroup *)(byuid + snap->nusers);
+	gids = (const uint32_t *)(groups + snap->ngroups);
+	strings = (const char *)(gids + snap->ngids);
+
+	if (snap->strsize == 0 || strings[snap->strsize - 1] != '\0')
+		return 0;
+	for (i = 0; i < snap->nusers; i++) {
+		if (!validstr(users[i].name) || !validstr(users[i].dir) ||
+		    !validstr(users[i].shell) || byuid[i] >= snap->nusers ||
+		    users[i].groups > snap->ngids ||
+		    users[i].ngroups > snap->ngids - users[i].groups)
+			return 0;
+	}
+	for (i = 0; i < snap->ngroups; i++)
+		if (!validstr(groups[i].name))
+			return 0;
+	return 1;
+}
+
+/*
+ * Map the snapshot if it exists.  A snapshot that is stale is marked to
+ * be rebuilt, and is not used once its grace period is over either.
+ */
+void
+idsnap_open(void)
+{
+	struct stat sb;
+	time_t now;
+	void *p;
+	int fd;
+
+	fd = open(IDSNAP_FILE, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd == -1)
+		return;
+	if (fstat(fd, &sb) != 0 || !S_ISREG(sb.st_mode) || sb.st_uid != 0 ||
+	    (sb.st_mode & (S_IWGRP|S_IWOTH)) != 0) {
+		close(fd);
+		return;
+	}
+	enabled = needupdate = 1;
+	if ((size_t)sb.st_size < sizeof(*snap)) {
+		close(fd);
+		return;
+	}
+	p = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		return;
+	snap = p;
+	now = time(NULL);
+	if (!snapvalid(sb.st_size) || now < snap->created ||
+	    now - snap->created >= IDSNAP_TTL + IDSNAP_GRACE) {
+		munmap(p, sb.st_size);
+		snap = NULL;
+		return;
+	}
+	needupdate = now - snap->created >= IDSNAP_TTL;
+}
+
+/*
+ * Whether the snapshot is in use but stale, or was built from another
+ * config.
+ */
+int
+idsnap_needsupdate(uint64_t confighash)
+{
+	return needupdate || (snap && snap->confighash != confighash);
+}
+
+static const struct idsnapuser *
+finduser(const char *name)
+{
+	uint32_t lo = 0, hi, mid;
+	int c;
+
+	if (!snap)
+		return NULL;
+	hi = snap->nusers;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if ((c = strcmp(name, strings + users[mid].name)) == 0)
+			return &users[mid];
+		if (c < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return NULL;
+}
+
+static const struct idsnapuser *
+finduid(uid_t uid)
+{
+	uint32_t lo = 0, hi, mid;
+
+	if (!snap)
+		return NULL;
+	hi = snap->nusers;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (users[byuid[mid]].uid == uid)
+			return &users[byuid[mid]];
+		if (users[byuid[mid]].uid > uid)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return NULL;
+}
+
+int
+idsnap_uid(const char *name, uid_t *uid)
+{
+	const struct idsnapuser *u;
+
+	if (!(u = finduser(name)))
+		return -1;
+	*uid = u->uid;
+	return 0;
+}
+
+int
+idsnap_gid(const char *name, gid_t *gid)
+{
+	uint32_t lo = 0, hi, mid;
+	int c;
+
+	if (!snap)
+		return -1;
+	hi = snap->ngroups;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if ((c = strcmp(name, strings + groups[mid].name)) == 0) {
+			*gid = groups[mid].gid;
+			return 0;
+		}
+		if (c < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return -1;
+}
+
+/* getpwuid(), answered from the snapshot if possible. */
+struct passwd *
+idsnap_getpwuid(uid_t uid)
+{
+	static struct passwd pw;
+	const struct idsnapuser *u;
+
+	if (!(u = finduid(uid)))
+		return getpwuid(uid);
+	memset(&pw, 0, sizeof(pw));
+	pw.pw_name = (char *)strings + u->name;
+	pw.pw_passwd = "*";
+	pw.pw_uid = u->uid;
+	pw.pw_gid = u->gid;
+	pw.pw_gecos = "";
+	pw.pw_dir = (char *)strings + u->dir;
+	pw.pw_shell = (char *)strings + u->shell;
+	return &pw;
+}
+
+/*
+ * The groups initgroups() would give uid, or -1 if the user is not in
+ * the snapshot.
+ */
+int
+idsnap_groups(uid_t uid, gid_t *list, int *nlist)
+{
+	const struct idsnapuser *u;
+	uint32_t i;
+
+	if (!(u = finduid(uid)) || (int)u->ngroups > *nlist)
+		return -1;
+	for (i = 0; i < u->ngroups; i++)
+		list[i] = gids[u->groups + i];
+	*nlist = u->ngroups;
+	return 0;
+}
+
+struct builder {
+	const char **users;
+	size_t nusers, maxusers;
+	struct idsnapuser *urecs;
+	struct idsnapgroup *grecs;
+	size_t ngrecs;
+	uint32_t *gids;
+	size_t ngids;
+	char *strings;
+	size_t strsize;
+};
+
+static void
+addname(struct builder *b, const char *name)
+{
+	if (b->nusers == b->maxusers) {
+		b->maxusers = b->maxusers ? b->maxusers * 2 : 64;
+		if (!(b->users = reallocarray(b->users, b->maxusers,
+		    sizeof(*b->users))))
+			err(1, "reallocarray");
+	}
+	if (!(b->users[b->nusers++] = strdup(name)))
+		err(1, "strdup");
+}
+
+static uint32_t
+addstring(struct builder *b, const char *s)
+{
+	size_t len = strlen(s) + 1;
+	uint32_t off = b->strsize;
+
+	if (!(b->strings = realloc(b->strings, b->strsize + len)))
+		err(1, "realloc");
+	memcpy(b->strings + b->strsize, s, len);
+	b->strsize += len;
+	return off;
+}
+
+static void
+addgroup(struct builder *b, const char *name, int members)
+{
+	struct group *gr;
+	char **m;
+
+	if (!(gr = getgrnam(name)))
+		return;
+	if (!(b->grecs = reallocarray(b->grecs, b->ngrecs + 1,
+	    sizeof(*b->grecs))))
+		err(1, "reallocarray");
+	b->grecs[b->ngrecs].gid = gr->gr_gid;
+	b->grecs[b->ngrecs].name = addstring(b, name);
+	b->ngrecs++;
+	/* the members are the likely callers */
+	for (m = gr->gr_mem; members && *m; m++)
+		addname(b, *m);
+}
+
+static const struct builder *sortb;
+
+static int
+usercmp(const void *a, const void *b)
+{
+	const struct idsnapuser *ua = a, *ub = b;
+
+	return strcmp(sortb->strings + ua->name, sortb->strings + ub->name);
+}
+
+static int
+grpcmp(const void *a, const void *b)
+{
+	const struct idsnapgroup *ga = a, *gb = b;
+
+	return strcmp(sortb->strings + ga->name, sortb->strings + gb->name);
+}
+
+static int
+uidcmp(const void *a, const void *b)
+{
+	uint32_t ua = sortb->urecs[*(const uint32_t *)a].uid;
+	uint32_t ub = sortb->urecs[*(const uint32_t *)b].uid;
+
+	return (ua > ub) - (ua < ub);
+}
+
+static int
+writeall(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		if ((n = write(fd, p, len)) <= 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* Whether the snapshot on disk was rebuilt for confighash meanwhile. */
+static int
+rebuilt(uint64_t confighash)
+{
+	struct idsnaphdr h;
+	time_t now = time(NULL);
+	int fd, ok;
+
+	if ((fd = open(IDSNAP_FILE, O_RDONLY | O_NOFOLLOW | O_CLOEXEC)) == -1)
+		return 0;
+	ok = read(fd, &h, sizeof(h)) == sizeof(h) &&
+	    h.magic == IDSNAP_MAGIC && h.version == IDSNAP_VERSION &&
+	    h.confighash == confighash && now >= h.created &&
+	    now - h.created < IDSNAP_TTL;
+	close(fd);
+	return ok;
+}
+
+/*
+ * Build a snapshot from the system databases for every name in pol,
+ * plus the given extra users and, if members is set, the members of
+ * the groups in pol, into a new file named after the template tmp.
+ * Returns -1 if it can't be written.
+ */
+static int
+build(const struct policy *pol, uint64_t confighash, const char **extra,
+    int members, char *tmp)
+{
+	struct builder b;
+	struct idsnaphdr h;
+	struct passwd *pw;
+	uint32_t *index;
+	size_t i, n;
+	int fd, r, j, anytarget = 0;
+
+	memset(&b, 0, sizeof(b));
+	for (r = 0; r < pol->nrules; r++) {
+		const struct rule *rule = pol->rules[r];
+		for (j = 0; j < rule->ident.nnames; j++) {
+			const char *ident = rule->ident.names[j];
+			if (ident[0] == ':')
+				addgroup(&b, ident + 1, members);
+			else
+				addname(&b, ident);
+		}
+		for (j = 0; j < rule->target.nnames; j++)
+			addname(&b, rule->target.names[j]);
+		if (rule->target.nnames == 0)
+			anytarget = 1;
+	}
+	/* the usual target of rules without one */
+	if (anytarget && (pw = getpwuid(0)))
+		addname(&b, pw->pw_name);
+	for (; extra && *extra; extra++)
+		addname(&b, *extra);
+
+	if (b.nusers > 0)
+		qsort(b.users, b.nusers, sizeof(*b.users), strpcmp);
+	if (!(b.urecs = reallocarray(NULL, b.nusers + 1, sizeof(*b.urecs))))
+		err(1, "reallocarray");
+	for (i = 0, n = 0; i < b.nusers; i++) {
+		gid_t list[NGROUPS_MAX + 1];
+		int nlist = NGROUPS_MAX + 1, g;
+
+		if (i > 0 && strcmp(b.users[i], b.users[i - 1]) == 0)
+			continue;
+		if (!(pw = getpwnam(b.users[i])))
+			continue;
+#ifdef __APPLE__
+		if (getgrouplist(pw->pw_name, (int)pw->pw_gid, (int *)list,
+		    &nlist) == -1)
+#else
+		if (getgrouplist(pw->pw_name, pw->pw_gid, list, &nlist) == -1)
+#endif
+			continue;
+		b.urecs[n].uid = pw->pw_uid;
+		b.urecs[n].gid = pw->pw_gid;
+		b.urecs[n].name = addstring(&b, pw->pw_name);
+		b.urecs[n].dir = addstring(&b, pw->pw_dir);
+		b.urecs[n].shell = addstring(&b, pw->pw_shell);
+		b.urecs[n].groups = b.ngids;
+		b.urecs[n].ngroups = nlist;
+		if (!(b.gids = reallocarray(b.gids, b.ngids + nlist + 1,
+		    sizeof(*b.gids))))
+			err(1, "reallocarray");
+		for (g = 0; g < nlist; g++)
+			b.gids[b.ngids++] = list[g];
+		n++;
+	}
+	if (b.strsize == 0)
+		addstring(&b, "");
+
+	sortb = &b;
+	qsort(b.urecs, n, sizeof(*b.urecs), usercmp);
+	qsort(b.grecs, b.ngrecs, sizeof(*b.grecs), grpcmp);
+	if (!(index = reallocarray(NULL, n + 1, sizeof(*index))))
+		err(1, "reallocarray");
+	for (i = 0; i < n; i++)
+		index[i] = i;
+	qsort(index, n, sizeof(*index), uidcmp);
+
+	memset(&h, 0, sizeof(h));
+	h.magic = IDSNAP_MAGIC;
+	h.version = IDSNAP_VERSION;
+	h.confighash = confighash;
+	h.created = time(NULL);
+	h.nusers = n;
+	h.ngroups = b.ngrecs;
+	h.ngids = b.ngids;
+	h.strsize = b.strsize;
+
+	r = -1;
+	if ((fd = mkstemp(tmp)) == -1)
+		goto done;
+	r = fchmod(fd, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH) != 0 ||
+	    writeall(fd, &h, sizeof(h)) != 0 ||
+	    writeall(fd, b.urecs, n * sizeof(*b.urecs)) != 0 ||
+	    writeall(fd, index, n * sizeof(*index)) != 0 ||
+	    writeall(fd, b.grecs, b.ngrecs * sizeof(*b.grecs)) != 0 ||
+	    writeall(fd, b.gids, b.ngids * sizeof(*b.gids)) != 0 ||
+	    writeall(fd, b.strings, b.strsize) != 0;
+	if (close(fd) != 0 || r) {
+		unlink(tmp);
+		r = -1;
+	}
+
+done:
+	for (i = 0; i < b.nusers; i++)
+		free((char *)b.users[i]);
+	free(b.users);
+	free(b.urecs);
+	free(b.grecs);
+	free(b.gids);
+	free(b.strings);
+	free(index);
+	return r;
+}
+
+static int
+openlock(void)
+{
+	return open(IDSNAP_LOCK, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC,
+	    S_IRUSR | S_IWUSR);
+}
+
+/*
+ * Rebuild the snapshot and atomically replace the old one.  If another
+ * process is already at it, this one leaves it alone rather than repeat
+ * every lookup.  Failure is silent, as doas works just as well without
+ * the snapshot.
+ */
+void
+idsnap_update(const struct policy *pol, uint64_t confighash,
+    const char **extra)
+{
+	char tmp[] = IDSNAP_FILE ".XXXXXXXXXX";
+	int lockfd;
+
+	if ((lockfd = openlock()) == -1)
+		return;
+	if (flock(lockfd, LOCK_EX | LOCK_NB) == 0 && !rebuilt(confighash) &&
+	    build(pol, confighash, extra, 0, tmp) == 0 &&
+	    rename(tmp, IDSNAP_FILE) != 0)
+		unlink(tmp);
+	close(lockfd);
+}
+
+static char staged[] = IDSNAP_FILE ".XXXXXXXXXX";
+static int stagedok, stagelock = -1;
+
+/*
+ * For root installing a config: build the full snapshot, group members
+ * included, ahead of time if the snapshot is enabled, waiting for any
+ * rebuild in progress, and hold off further rebuilds until
+ * idsnap_unstage().  idsnap_commit() then puts it in place.
+ */
+void
+idsnap_stage(const struct policy *pol, uint64_t confighash)
+{
+	if (enabled && (stagelock = openlock()) != -1 &&
+	    flock(stagelock, LOCK_EX) == 0 &&
+	    build(pol, confighash, NULL, 1, staged) == 0)
+		stagedok = 1;
+}
+
+void
+idsnap_commit(void)
+{
+	if (stagedok && rename(staged, IDSNAP_FILE) == 0)
+		stagedok = 0;
+}
+
+void
+idsnap_unstage(void)
+{
+	if (stagedok)
+		unlink(staged);
+	stagedok = 0;
+	if (stagelock != -1)
+		close(stagelock);
+	stagelock = -1;
+}
@@ -23,7 +23,9 @@
 #include <stdlib.h>
 #include <string.h>
 
+#ifndef NOPAM
 #include <security/pam_appl.h>
+#endif
 
 #include "openbsd.h"
 
@@ -31,6 +33,18 @@
 
 #define __UNUSED __attribute__ ((unused))
 
+#ifdef NOPAM
+/*
+ * The static build can't load PAM without a second libc, so it only
+ * serves nopass rules.
+ */
+int
+auth_userokay(__UNUSED char *name, __UNUSED char *style,
+		__UNUSED char *type, __UNUSED char *password)
+{
+	errx(1, "password authentication is not available in this build");
+}
+#else
 static char *
 pam_prompt(const char *msg, int echo_on, int *pam)
 {
@@ -55,9 +69,8 @@ pam_conv(int nmsgs, const struct pam_message **msgs,
 
 	if (!(rsp = calloc(nmsgs, sizeof(struct pam_response))))
 		errx(1, "couldn't malloc pam_response");
-	*rsps = rsp;
 
-	for (i = 0; i < nmsgs; i++) {
+	for (i = 0; i < nmsgs && pam == PAM_SUCCESS; i++) {
 		switch (style = msgs[i]->msg_style) {
 		case PAM_PROMPT_ECHO_OFF:
 		case PAM_PROMPT_ECHO_ON:
@@ -73,11 +86,27 @@ pam_conv(int nmsgs, const struct pam_message **msgs,
 			break;
 
 		default:
-			errx(1, "invalid PAM msg_style %d", style);
+			warnx("invalid PAM msg_style %d", style);
+			pam = PAM_CONV_ERR;
+			break;
+		}
+	}
+
+	/* PAM only takes the responses if the whole conversation worked */
+	if (pam != PAM_SUCCESS) {
+		for (i = 0; i < nmsgs; i++) {
+			if (rsp[i].resp) {
+				explicit_bzero(rsp[i].resp,
+						strlen(rsp[i].resp));
+				free(rsp[i].resp);
+			}
 		}
+		free(rsp);
+		rsp = NULL;
 	}
+	*rsps = rsp;
 
-	return PAM_SUCCESS;
+	return pam;
 }
 
 int
@@ -96,17 +125,23 @@ auth_userokay(char *name, char *style, char *type, char *password)
 	if (style || type || password)
 		errx(1, "auth_userokay(name, NULL, NULL, NULL)!\n");
 
+#ifdef PAM_CONFDIR
+	/* the regress tests bring their own service file */
+	ret = pam_start_confdir(PAM_SERVICE, name, &conv, PAM_CONFDIR, &pamh);
+#else
 	ret = pam_start(PAM_SERVICE, name, &conv, &pamh);
+#endif
 	if (ret != PAM_SUCCESS)
 		errx(1, "pam_start(\"%s\", \"%s\", ?, ?): failed\n",
 				PAM_SERVICE, name);
 
 	auth = pam_authenticate(pamh, 0);
 
-	ret = pam_close_session(pamh, 0);
+	/* no session was opened; just release the handle and its modules */
+	ret = pam_end(pamh, auth);
 	if (ret != PAM_SUCCESS)
-		errx(1, "pam_close_session(): %s\n", pam_strerror(pamh, ret));
+		errx(1, "pam_end(): failed\n");
 
 	return auth == PAM_SUCCESS;
 }
-
+#endif
@@ -2,6 +2,8 @@
 #define _LIB_OPENBSD_H_
 
 #include <sys/types.h>
+#include <sys/resource.h>
+#include <stdint.h>
 
 /* API definitions lifted from OpenBSD src/include */
 
@@ -19,6 +21,34 @@ int auth_userokay(char *, char *, char *, char *);
 #define        LOGIN_SETENV            0x0080  /* Set environment */
 #define        LOGIN_SETALL            0x00ff  /* Set all. */
 
+/*
+ * OpenBSD looks these up in the login class; here the caller fills
+ * them in.  lcap_set tells which of the single valued ones are in use.
+ */
+#define        LCAP_NICE               0x01
+#define        LCAP_IOPRIO             0x02
+#define        LCAP_CPUS               0x04
+#define        LCAP_CGROUP             0x08
+#define        LCAP_GROUPS             0x10
+#define        LCAP_MAXRLIMITS         16
+#define        LCAP_MAXCPUS            1024
+
+struct login_cap {
+	int lcap_set;
+	int lcap_nice;
+	int lcap_ioclass;
+	int lcap_iolevel;
+	uint64_t lcap_cpus[LCAP_MAXCPUS / 64];
+	const char *lcap_cgroup;	/* relative to the cgroup v2 mount */
+	const gid_t *lcap_groups;	/* instead of initgroups() */
+	int lcap_ngroups;
+	int lcap_nrlimits;
+	struct {
+		int resource;
+		rlim_t value;
+	} lcap_rlimits[LCAP_MAXRLIMITS];
+};
+
 typedef struct login_cap login_cap_t;
 struct passwd;
 int setusercontext(login_cap_t *, struct passwd *, uid_t, unsigned int);
@@ -26,6 +56,36 @@ int setusercontext(login_cap_t *, struct passwd *, uid_t, unsigned int);
 /* pwd.h */
 #define _PW_NAME_LEN 63
 
+/*
+ * The static build looks users and groups up in /etc/passwd and
+ * /etc/group only, see pwfiles.c.
+ */
+#ifdef NONSS
+#include <grp.h>
+#include <pwd.h>
+
+struct passwd *files_getpwnam(const char *);
+struct passwd *files_getpwuid(uid_t);
+int files_getpwnam_r(const char *, struct passwd *, char *, size_t,
+		struct passwd **);
+struct group *files_getgrnam(const char *);
+struct group *files_getgrgid(gid_t);
+int files_getgrnam_r(const char *, struct group *, char *, size_t,
+		struct group **);
+int files_getgrouplist(const char *, gid_t, gid_t *, int *);
+int files_initgroups(const char *, gid_t);
+int files_missed(void);
+
+#define getpwnam	files_getpwnam
+#define getpwuid	files_getpwuid
+#define getpwnam_r	files_getpwnam_r
+#define getgrnam	files_getgrnam
+#define getgrgid	files_getgrgid
+#define getgrnam_r	files_getgrnam_r
+#define getgrouplist	files_getgrouplist
+#define initgroups	files_initgroups
+#endif
+
 /* stdlib.h */
 void * reallocarray(void *optr, size_t nmemb, size_t size);
 long long strtonum(const char *numstr, long long minval,
@@ -0,0 +1,255 @@
+/*
+ * Copyright (c) 2016 Nathan Holstein <nathan.holstein@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE	/* fgetpwent_r(), fgetgrent_r(), setgroups() */
+#endif
+
+#include <sys/types.h>
+#include <errno.h>
+#include <grp.h>
+#include <limits.h>
+#include <pwd.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "openbsd.h"
+
+/*
+ * The user and group lookups of the static build.  A static glibc
+ * binary can only use NSS by loading the shared modules, and with them
+ * a second libc, so this build reads /etc/passwd and /etc/group and
+ * nothing else.  openbsd.h maps the usual names onto these.  A name or
+ * id the files don't have may still be known to NSS, so each one not
+ * found is noted for files_missed().
+ */
+
+#define PATH_PASSWD	"/etc/passwd"
+#define PATH_GROUP	"/etc/group"
+
+/* set from the prefetch threads too */
+static atomic_int missed;
+
+/* Look for name, or uid if name is NULL; ERANGE asks for a larger buf. */
+static int
+pwscan(const char *name, uid_t uid, struct passwd *pw, char *buf,
+    size_t len, struct passwd **res)
+{
+	FILE *fp;
+	int ret;
+
+	*res = NULL;
+	if (!(fp = fopen(PATH_PASSWD, "re")))
+		return errno;
+	while ((ret = fgetpwent_r(fp, pw, buf, len, res)) == 0)
+		if (name ? strcmp(pw->pw_name, name) == 0 : pw->pw_uid == uid)
+			break;
+	fclose(fp);
+	if (ret != 0)
+		*res = NULL;
+	if (ret != 0 && ret != ERANGE)
+		missed = 1;
+	return ret == ENOENT ? 0 : ret;
+}
+
+static int
+grscan(const char *name, gid_t gid, struct group *gr, char *buf,
+    size_t len, struct group **res)
+{
+	FILE *fp;
+	int ret;
+
+	*res = NULL;
+	if (!(fp = fopen(PATH_GROUP, "re")))
+		return errno;
+	while ((ret = fgetgrent_r(fp, gr, buf, len, res)) == 0)
+		if (name ? strcmp(gr->gr_name, name) == 0 : gr->gr_gid == gid)
+			break;
+	fclose(fp);
+	if (ret != 0)
+		*res = NULL;
+	if (ret != 0 && ret != ERANGE)
+		missed = 1;
+	return ret == ENOENT ? 0 : ret;
+}
+
+/* Double *bufp, which starts out at 1k; returns -1 past 1M. */
+static int
+grow(char **bufp, size_t *lenp)
+{
+	size_t len = *bufp ? *lenp * 2 : 1024;
+	char *buf;
+
+	if (len > 1024 * 1024 || !(buf = realloc(*bufp, len)))
+		return -1;
+	*bufp = buf;
+	*lenp = len;
+	return 0;
+}
+
+static struct passwd *
+lookuppw(const char *name, uid_t uid)
+{
+	static struct passwd pw;
+	static char *buf;
+	static size_t len;
+	struct passwd *res;
+
+	if (!buf && grow(&buf, &len) == -1)
+		goto fail;
+	while (pwscan(name, uid, &pw, buf, len, &res) == ERANGE)
+		if (grow(&buf, &len) == -1)
+			goto fail;
+	return res;
+fail:
+	missed = 1;
+	return NULL;
+}
+
+static struct group *
+lookupgr(const char *name, gid_t gid)
+{
+	static struct group gr;
+	static char *buf;
+	static size_t len;
+	struct group *res;
+
+	if (!buf && grow(&buf, &len) == -1)
+		goto fail;
+	while (grscan(name, gid, &gr, buf, len, &res) == ERANGE)
+		if (grow(&buf, &len) == -1)
+			goto fail;
+	return res;
+fail:
+	missed = 1;
+	return NULL;
+}
+
+struct passwd *
+files_getpwnam(const char *name)
+{
+	return lookuppw(name, 0);
+}
+
+struct passwd *
+files_getpwuid(uid_t uid)
+{
+	return lookuppw(NULL, uid);
+}
+
+int
+files_getpwnam_r(const char *name, struct passwd *pw, char *buf, size_t len,
+    struct passwd **res)
+{
+	return pwscan(name, 0, pw, buf, len, res);
+}
+
+struct group *
+files_getgrnam(const char *name)
+{
+	return lookupgr(name, 0);
+}
+
+struct group *
+files_getgrgid(gid_t gid)
+{
+	return lookupgr(NULL, gid);
+}
+
+int
+files_getgrnam_r(const char *name, struct group *gr, char *buf, size_t len,
+    struct group **res)
+{
+	return grscan(name, 0, gr, buf, len, res);
+}
+
+/* Add gid to the list unless it is there; counts past *ngroups too. */
+static void
+addgid(gid_t *groups, int max, int *n, gid_t gid)
+{
+	int i;
+
+	for (i = 0; i < *n && i < max; i++)
+		if (groups[i] == gid)
+			return;
+	if (*n < max)
+		groups[*n] = gid;
+	(*n)++;
+}
+
+/*
+ * Like glibc's: returns the number of groups, or -1 with *ngroups set
+ * to the number needed if they don't fit.
+ */
+int
+files_getgrouplist(const char *user, gid_t group, gid_t *groups,
+    int *ngroups)
+{
+	struct group gr, *res;
+	char *buf = NULL;
+	size_t len = 0;
+	FILE *fp;
+	char **m;
+	int n, ret = ERANGE;
+
+	while (ret == ERANGE) {
+		if (grow(&buf, &len) == -1 || !(fp = fopen(PATH_GROUP, "re"))) {
+			free(buf);
+			return -1;
+		}
+		n = 0;
+		addgid(groups, *ngroups, &n, group);
+		while ((ret = fgetgrent_r(fp, &gr, buf, len, &res)) == 0)
+			for (m = gr.gr_mem; *m; m++)
+				if (strcmp(*m, user) == 0) {
+					addgid(groups, *ngroups, &n, gr.gr_gid);
+					break;
+				}
+		fclose(fp);
+	}
+	free(buf);
+	if (n > *ngroups) {
+		*ngroups = n;
+		return -1;
+	}
+	*ngroups = n;
+	return n;
+}
+
+/*
+ * Whether a lookup has failed to find a name or id in the files; the
+ * groups getgrouplist() finds there are taken as complete.
+ */
+int
+files_missed(void)
+{
+	return missed;
+}
+
+int
+files_initgroups(const char *user, gid_t group)
+{
+	gid_t groups[NGROUPS_MAX + 1];
+	int n = NGROUPS_MAX + 1;
+
+	if (files_getgrouplist(user, group, groups, &n) == -1) {
+		errno = EINVAL;
+		return -1;
+	}
+	return setgroups(n, groups);
+}
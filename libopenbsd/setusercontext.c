@@ -14,22 +14,103 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE	/* sched_setaffinity() */
+#endif
+
 #include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <limits.h>
 #include <pwd.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 
+#ifdef __linux__
+#include <sched.h>
+#include <sys/syscall.h>
+#endif
+
 #include "openbsd.h"
 
+#define CGROUP_ROOT "/sys/fs/cgroup/"
+
+#ifdef __linux__
+static int
+setcgroup(const char *cgroup)
+{
+	char path[PATH_MAX], pid[32];
+	int fd, len;
+
+	if ((size_t)snprintf(path, sizeof(path), "%s%s/cgroup.procs",
+	    CGROUP_ROOT, cgroup) >= sizeof(path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	if ((fd = open(path, O_WRONLY | O_CLOEXEC)) == -1)
+		return -1;
+	len = snprintf(pid, sizeof(pid), "%ld\n", (long)getpid());
+	if (write(fd, pid, len) != len) {
+		close(fd);
+		return -1;
+	}
+	return close(fd);
+}
+
+static int
+setcpus(const uint64_t *cpus)
+{
+	cpu_set_t set;
+	int i;
+
+	CPU_ZERO(&set);
+	for (i = 0; i < LCAP_MAXCPUS && i < CPU_SETSIZE; i++)
+		if (cpus[i / 64] & (UINT64_C(1) << (i % 64)))
+			CPU_SET(i, &set);
+	return sched_setaffinity(0, sizeof(set), &set);
+}
+#endif
+
+static int
+setresources(login_cap_t *lc)
+{
+	struct rlimit rl;
+	int i;
+
+	for (i = 0; i < lc->lcap_nrlimits; i++) {
+		rl.rlim_cur = rl.rlim_max = lc->lcap_rlimits[i].value;
+		if (setrlimit(lc->lcap_rlimits[i].resource, &rl) != 0)
+			return -1;
+	}
+
+#ifdef __linux__
+	/* IOPRIO_WHO_PROCESS, with the class in the top three bits */
+	if ((lc->lcap_set & LCAP_IOPRIO) && syscall(SYS_ioprio_set, 1, 0,
+	    (lc->lcap_ioclass << 13) | lc->lcap_iolevel) != 0)
+		return -1;
+	if ((lc->lcap_set & LCAP_CPUS) && setcpus(lc->lcap_cpus) != 0)
+		return -1;
+	if ((lc->lcap_set & LCAP_CGROUP) && setcgroup(lc->lcap_cgroup) != 0)
+		return -1;
+#else
+	if (lc->lcap_set & (LCAP_IOPRIO | LCAP_CPUS | LCAP_CGROUP)) {
+		errno = ENOTSUP;
+		return -1;
+	}
+#endif
+	return 0;
+}
+
 int
 setusercontext(login_cap_t *lc, struct passwd *pw, uid_t uid, unsigned int flags)
 {
 	int ret;
 
-	if (lc != NULL || pw == NULL ||
+	if (pw == NULL ||
 			(flags & ~(LOGIN_SETGROUP | LOGIN_SETPRIORITY |
 			           LOGIN_SETRESOURCES | LOGIN_SETUMASK |
 			           LOGIN_SETUSER)) != 0) {
@@ -40,7 +121,11 @@ setusercontext(login_cap_t *lc, struct passwd *pw, uid_t uid, unsigned int flags
 	if (flags & LOGIN_SETGROUP) {
 		if ((ret = setgid(pw->pw_gid)) != 0)
 			return ret;
-		if ((ret = initgroups(pw->pw_name, pw->pw_gid)) != 0)
+		if (lc && (lc->lcap_set & LCAP_GROUPS))
+			ret = setgroups(lc->lcap_ngroups, lc->lcap_groups);
+		else
+			ret = initgroups(pw->pw_name, pw->pw_gid);
+		if (ret != 0)
 			return ret;
 	}
 
@@ -49,9 +134,15 @@ setusercontext(login_cap_t *lc, struct passwd *pw, uid_t uid, unsigned int flags
 			return ret;
 		if ((ret = setpriority(PRIO_USER, uid, 0)) != 0)
 			return ret;
+		if (lc && (lc->lcap_set & LCAP_NICE) &&
+		    (ret = setpriority(PRIO_PROCESS, getpid(),
+		    lc->lcap_nice)) != 0)
+			return ret;
 	}
 
 	if (flags & LOGIN_SETRESOURCES) {
+		if (lc && (ret = setresources(lc)) != 0)
+			return ret;
 	}
 
 	if (flags & LOGIN_SETUMASK)
@@ -17,8 +17,10 @@
 
 %{
 #include <sys/types.h>
+#include <sys/resource.h>
 #include <ctype.h>
-#include <err.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdint.h>
@@ -28,16 +30,18 @@
 
 #include "openbsd.h"
 
-#include "doas.h"
+#include "policy.h"
+#include "allocstats.h"
 
 typedef struct {
 	union {
 		struct {
 			int action;
 			int options;
-			const char *cmd;
+			struct nameset set;
 			const char **cmdargs;
 			const char **envlist;
+			struct resources *res;
 		};
 		const char *str;
 	};
@@ -46,20 +50,35 @@ typedef struct {
 } yystype;
 #define YYSTYPE yystype
 
-FILE *yyfp;
+/*
+ * yacc keeps its state in globals, so parsing is serialized; the
+ * policy being built and its input are only valid under parselock.
+ */
+static pthread_mutex_t parselock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *yyfp;
+static struct policy *curpol;
 
-struct rule **rules;
-int nrules, maxrules;
-int parse_errors = 0;
+static struct resources *resnice(const char *);
+static struct resources *resrlimit(const char *, const char *);
+static struct resources *resioclass(const char *);
+static struct resources *rescpus(const char *);
+static struct resources *rescgroup(const char *);
+static int mergeres(struct resources **, struct resources *);
+static int mergeopts(yystype *, const yystype *, const yystype *);
+static int addrule(const yystype *, const yystype *, const yystype *,
+    const yystype *);
+static int addname(struct nameset *, const char *);
+static int closeset(struct nameset *);
 
-void yyerror(const char *, ...);
-int yylex(void);
+static void yyerror(const char *, ...);
+static int yylex(void);
 int yyparse(void);
 
 %}
 
 %token TPERMIT TDENY TAS TCMD TARGS
 %token TNOPASS TKEEPENV
+%token TNICE TRLIMIT TIOCLASS TCPUS TCGROUP
 %token TSTRING
 
 %%
@@ -70,61 +89,107 @@ grammar:	/* empty */
 		| error '\n'
 		;
 
+/*
+ * "keepenv {" always starts the keepenv list, so a bare keepenv at the
+ * end of the options must be followed by a single identity instead of
+ * a set.
+ */
 rule:		action ident target cmd {
-			struct rule *r;
-			r = calloc(1, sizeof(*r));
-			if (!r)
-				errx(1, "can't allocate rule");
-			r->action = $1.action;
-			r->options = $1.options;
-			r->envlist = $1.envlist;
-			r->ident = $2.str;
-			r->target = $3.str;
-			r->cmd = $4.cmd;
-			r->cmdargs = $4.cmdargs;
-			if (nrules == maxrules) {
-				if (maxrules == 0)
-					maxrules = 63;
-				else
-					maxrules *= 2;
-				if (!(rules = reallocarray(rules, maxrules,
-				    sizeof(*rules))))
-					errx(1, "can't allocate rules");
-			}
-			rules[nrules++] = r;
+			if (addrule(&$1, &$2, &$3, &$4) == -1)
+				YYABORT;
+		} | kaction name target cmd {
+			if (addrule(&$1, &$2, &$3, &$4) == -1)
+				YYABORT;
 		} ;
 
 action:		TPERMIT options {
 			$$.action = PERMIT;
 			$$.options = $2.options;
 			$$.envlist = $2.envlist;
+			$$.res = $2.res;
 		} | TDENY {
 			$$.action = DENY;
+			$$.options = 0;
+			$$.envlist = NULL;
+			$$.res = NULL;
+		} ;
+
+kaction:	TPERMIT koptions {
+			$$.action = PERMIT;
+			$$.options = $2.options;
+			$$.envlist = $2.envlist;
+			$$.res = $2.res;
 		} ;
 
 options:	/* none */ {
 			$$.options = 0;
 			$$.envlist = NULL;
+			$$.res = NULL;
 		} | options option {
-			$$.options = $1.options | $2.options;
+			if (mergeopts(&$$, &$1, &$2) == -1)
+				YYERROR;
+		} | koptions option {
+			if (mergeopts(&$$, &$1, &$2) == -1)
+				YYERROR;
+		} ;
+
+/* options ending in a bare keepenv */
+koptions:	options TKEEPENV {
+			$$.options = $1.options | KEEPENV;
 			$$.envlist = $1.envlist;
-			if ($2.envlist) {
-				if ($$.envlist) {
-					yyerror("can't have two keepenv sections");
-					YYERROR;
-				} else
-					$$.envlist = $2.envlist;
-			}
+			$$.res = $1.res;
+		} | koptions TKEEPENV {
+			$$ = $1;
 		} ;
+
 option:		TNOPASS {
 			$$.options = NOPASS;
 			$$.envlist = NULL;
-		} | TKEEPENV {
-			$$.options = KEEPENV;
-			$$.envlist = NULL;
+			$$.res = NULL;
 		} | TKEEPENV '{' envlist '}' {
 			$$.options = KEEPENV;
 			$$.envlist = $3.envlist;
+			$$.res = NULL;
+		} | TNICE TSTRING {
+			$$.options = 0;
+			$$.envlist = NULL;
+			$$.res = resnice($2.str);
+			free((char *)$2.str);
+			if (!$$.res)
+				YYERROR;
+		} | TRLIMIT TSTRING TSTRING {
+			$$.options = 0;
+			$$.envlist = NULL;
+			$$.res = resrlimit($2.str, $3.str);
+			free((char *)$2.str);
+			free((char *)$3.str);
+			if (!$$.res)
+				YYERROR;
+		} | TRLIMIT TAS TSTRING {
+			/* the lexer has taken the resource for the keyword */
+			$$.options = 0;
+			$$.envlist = NULL;
+			$$.res = resrlimit("as", $3.str);
+			free((char *)$3.str);
+			if (!$$.res)
+				YYERROR;
+		} | TIOCLASS TSTRING {
+			$$.options = 0;
+			$$.envlist = NULL;
+			$$.res = resioclass($2.str);
+			free((char *)$2.str);
+			if (!$$.res)
+				YYERROR;
+		} | TCPUS TSTRING {
+			$$.options = 0;
+			$$.envlist = NULL;
+			if (!($$.res = rescpus($2.str)))
+				YYERROR;
+		} | TCGROUP TSTRING {
+			$$.options = 0;
+			$$.envlist = NULL;
+			if (!($$.res = rescgroup($2.str)))
+				YYERROR;
 		} ;
 
 envlist:	/* empty */ {
@@ -132,31 +197,59 @@ envlist:	/* empty */ {
 		} | envlist TSTRING {
 			int nenv = arraylen($1.envlist);
 			if (!($$.envlist = reallocarray($1.envlist, nenv + 2,
-			    sizeof(char *))))
-				errx(1, "can't allocate envlist");
+			    sizeof(char *)))) {
+				yyerror("can't allocate envlist");
+				YYABORT;
+			}
 			$$.envlist[nenv] = $2.str;
 			$$.envlist[nenv + 1] = NULL;
 		}
 
 
-ident:		TSTRING {
-			$$.str = $1.str;
+ident:		names {
+			$$.set = $1.set;
 		} ;
 
 target:		/* optional */ {
-			$$.str = NULL;
-		} | TAS TSTRING {
-			$$.str = $2.str;
+			$$.set.names = NULL;
+			$$.set.nnames = 0;
+		} | TAS names {
+			$$.set = $2.set;
 		} ;
 
 cmd:		/* optional */ {
-			$$.cmd = NULL;
+			$$.set.names = NULL;
+			$$.set.nnames = 0;
 			$$.cmdargs = NULL;
-		} | TCMD TSTRING args {
-			$$.cmd = $2.str;
+		} | TCMD names args {
+			$$.set = $2.set;
 			$$.cmdargs = $3.cmdargs;
 		} ;
 
+names:		name {
+			$$.set = $1.set;
+		} | '{' namelist '}' {
+			$$.set = $2.set;
+			if (closeset(&$$.set) == -1)
+				YYERROR;
+		} ;
+
+name:		TSTRING {
+			$$.set.names = NULL;
+			$$.set.nnames = 0;
+			if (addname(&$$.set, $1.str) == -1)
+				YYABORT;
+		} ;
+
+namelist:	/* empty */ {
+			$$.set.names = NULL;
+			$$.set.nnames = 0;
+		} | namelist TSTRING {
+			$$.set = $1.set;
+			if (addname(&$$.set, $2.str) == -1)
+				YYABORT;
+		} ;
+
 args:		/* empty */ {
 			$$.cmdargs = NULL;
 		} | TARGS argslist {
@@ -168,27 +261,396 @@ argslist:	/* empty */ {
 		} | argslist TSTRING {
 			int nargs = arraylen($1.cmdargs);
 			if (!($$.cmdargs = reallocarray($1.cmdargs, nargs + 2,
-			    sizeof(char *))))
-				errx(1, "can't allocate args");
+			    sizeof(char *)))) {
+				yyerror("can't allocate args");
+				YYABORT;
+			}
 			$$.cmdargs[nargs] = $2.str;
 			$$.cmdargs[nargs + 1] = NULL;
 		} ;
 
 %%
 
-void
+struct policy *
+policy_parse(FILE *fp)
+{
+	struct policy *pol;
+	int ret;
+
+	if (!(pol = calloc(1, sizeof(*pol))))
+		return NULL;
+
+	pthread_mutex_lock(&parselock);
+	yyfp = fp;
+	curpol = pol;
+	yylval.lineno = 0;
+	yylval.colno = 0;
+	ret = yyparse();
+	if (ret != 0 && pol->nerrors == 0)
+		pol->nerrors++;
+	curpol = NULL;
+	yyfp = NULL;
+	pthread_mutex_unlock(&parselock);
+
+	return pol;
+}
+
+/*
+ * Errors are collected in the policy, one message per line, for the
+ * caller to report.
+ */
+static void
 yyerror(const char *fmt, ...)
 {
+	char msg[1024], *errors;
+	size_t len, oldlen;
 	va_list va;
+	int n;
+
+	curpol->nerrors++;
 
 	va_start(va, fmt);
-	vfprintf(stderr, fmt, va);
+	n = vsnprintf(msg, sizeof(msg), fmt, va);
 	va_end(va);
-	fprintf(stderr, " at line %d\n", yylval.lineno + 1);
-	parse_errors++;
+	if (n < 0)
+		return;
+	len = strlen(msg);
+	(void) snprintf(msg + len, sizeof(msg) - len, " at line %d\n",
+	    yylval.lineno + 1);
+
+	oldlen = curpol->errors ? strlen(curpol->errors) : 0;
+	len = strlen(msg);
+	if (!(errors = realloc(curpol->errors, oldlen + len + 1)))
+		return;
+	memcpy(errors + oldlen, msg, len + 1);
+	curpol->errors = errors;
+}
+
+/* Combine the options a and b into dst. */
+static int
+mergeopts(yystype *dst, const yystype *a, const yystype *b)
+{
+	struct resources *res = a->res;
+
+	if (a->envlist && b->envlist) {
+		yyerror("can't have two keepenv sections");
+		return -1;
+	}
+	if (b->res && mergeres(&res, b->res) == -1)
+		return -1;
+	dst->options = a->options | b->options;
+	dst->envlist = a->envlist ? a->envlist : b->envlist;
+	dst->res = res;
+	return 0;
+}
+
+static int
+addrule(const yystype *action, const yystype *ident, const yystype *target,
+    const yystype *cmd)
+{
+	struct rule *r;
+
+	if (!(r = calloc(1, sizeof(*r)))) {
+		yyerror("can't allocate rule");
+		return -1;
+	}
+	r->action = action->action;
+	r->options = action->options;
+	r->envlist = action->envlist;
+	r->res = action->res;
+	r->ident = ident->set;
+	r->target = target->set;
+	r->cmd = cmd->set;
+	r->cmdargs = cmd->cmdargs;
+	r->lineno = action->lineno + 1;
+	if (curpol->nrules == curpol->maxrules) {
+		struct rule **nr;
+		int max = curpol->maxrules ? curpol->maxrules * 2 : 63;
+		if (!(nr = reallocarray(curpol->rules, max, sizeof(*nr)))) {
+			free(r);
+			yyerror("can't allocate rules");
+			return -1;
+		}
+		curpol->rules = nr;
+		curpol->maxrules = max;
+	}
+	curpol->rules[curpol->nrules++] = r;
+	return 0;
+}
+
+/* Append a name, keeping the list NULL terminated for freelist(). */
+static int
+addname(struct nameset *set, const char *name)
+{
+	const char **names;
+
+	if (!(names = reallocarray(set->names, set->nnames + 2,
+	    sizeof(*names)))) {
+		free((char *)name);
+		yyerror("can't allocate names");
+		return -1;
+	}
+	names[set->nnames++] = name;
+	names[set->nnames] = NULL;
+	set->names = names;
+	return 0;
+}
+
+/* Sort a braced set and drop duplicates so it can be searched. */
+static int
+closeset(struct nameset *set)
+{
+	int i, n;
+
+	if (set->nnames == 0) {
+		yyerror("empty set");
+		return -1;
+	}
+	qsort(set->names, set->nnames, sizeof(*set->names), strpcmp);
+	for (i = n = 1; i < set->nnames; i++) {
+		if (strcmp(set->names[i], set->names[n - 1]) == 0)
+			free((char *)set->names[i]);
+		else
+			set->names[n++] = set->names[i];
+	}
+	set->names[n] = NULL;
+	set->nnames = n;
+	return 0;
+}
+
+static const struct {
+	const char *name;
+	int resource;
+} rlimitnames[] = {
+	{ "as", RLIMIT_AS },
+	{ "core", RLIMIT_CORE },
+	{ "cpu", RLIMIT_CPU },
+	{ "data", RLIMIT_DATA },
+	{ "fsize", RLIMIT_FSIZE },
+	{ "memlock", RLIMIT_MEMLOCK },
+	{ "nofile", RLIMIT_NOFILE },
+	{ "nproc", RLIMIT_NPROC },
+	{ "rss", RLIMIT_RSS },
+	{ "stack", RLIMIT_STACK },
+};
+
+static const char *ioclassnames[] = {
+	NULL, "realtime", "best-effort", "idle",
+};
+
+static struct resources *
+newres(int set)
+{
+	struct resources *res;
+
+	if (!(res = calloc(1, sizeof(*res)))) {
+		yyerror("can't allocate resources");
+		return NULL;
+	}
+	res->set = set;
+	return res;
+}
+
+static struct resources *
+resnice(const char *s)
+{
+	struct resources *res;
+	const char *errstr;
+	int nice;
+
+	nice = strtonum(s, PRIO_MIN, PRIO_MAX - 1, &errstr);
+	if (errstr) {
+		yyerror("nice value %s is %s", s, errstr);
+		return NULL;
+	}
+	if (!(res = newres(RES_NICE)))
+		return NULL;
+	res->nice = nice;
+	return res;
+}
+
+static struct resources *
+resrlimit(const char *name, const char *value)
+{
+	struct resources *res;
+	const char *errstr;
+	rlim_t v;
+	size_t i;
+
+	for (i = 0; i < sizeof(rlimitnames) / sizeof(rlimitnames[0]); i++)
+		if (strcmp(name, rlimitnames[i].name) == 0)
+			break;
+	if (i == sizeof(rlimitnames) / sizeof(rlimitnames[0])) {
+		yyerror("unknown rlimit %s", name);
+		return NULL;
+	}
+	if (strcmp(value, "infinity") == 0)
+		v = RLIM_INFINITY;
+	else {
+		v = strtonum(value, 0, LLONG_MAX, &errstr);
+		if (errstr) {
+			yyerror("rlimit %s value %s is %s", name, value,
+			    errstr);
+			return NULL;
+		}
+	}
+	if (!(res = newres(0)))
+		return NULL;
+	res->rlimits[0].name = rlimitnames[i].name;
+	res->rlimits[0].resource = rlimitnames[i].resource;
+	res->rlimits[0].value = v;
+	res->nrlimits = 1;
+	return res;
+}
+
+/* "idle", or "realtime" and "best-effort" with an optional ":level" */
+static struct resources *
+resioclass(const char *s)
+{
+	struct resources *res;
+	const char *errstr, *colon;
+	size_t len;
+	int class, level = 4;
+
+	colon = strchr(s, ':');
+	len = colon ? (size_t)(colon - s) : strlen(s);
+	for (class = 1; class <= 3; class++)
+		if (strlen(ioclassnames[class]) == len &&
+		    strncmp(s, ioclassnames[class], len) == 0)
+			break;
+	if (class > 3) {
+		yyerror("unknown ioclass %s", s);
+		return NULL;
+	}
+	if (colon) {
+		level = strtonum(colon + 1, 0, 7, &errstr);
+		if (errstr || class == 3) {
+			yyerror("invalid ioclass level in %s", s);
+			return NULL;
+		}
+	}
+	if (!(res = newres(RES_IOCLASS)))
+		return NULL;
+	res->ioclass = class;
+	res->iolevel = class == 3 ? 0 : level;
+	return res;
 }
 
-struct keyword {
+/* a comma separated list of cpu numbers and ranges, e.g. "0-3,6" */
+static struct resources *
+rescpus(const char *s)
+{
+	struct resources *res;
+	const char *p;
+	char *ep;
+	long lo, hi;
+
+	if (!(res = newres(RES_CPUS)))
+		return NULL;
+	for (p = s; ; p = ep + 1) {
+		if (!isdigit((unsigned char)*p))
+			goto bad;
+		lo = hi = strtol(p, &ep, 10);
+		if (*ep == '-') {
+			if (!isdigit((unsigned char)ep[1]))
+				goto bad;
+			hi = strtol(ep + 1, &ep, 10);
+		}
+		if (lo > hi || hi >= RES_MAXCPUS)
+			goto bad;
+		for (; lo <= hi; lo++)
+			res->cpus[lo / 64] |= UINT64_C(1) << (lo % 64);
+		if (*ep == '\0')
+			break;
+		if (*ep != ',')
+			goto bad;
+	}
+	res->cpulist = s;
+	return res;
+
+bad:
+	yyerror("invalid cpu list %s", s);
+	free(res);
+	return NULL;
+}
+
+/* a path below the cgroup v2 mount point, without any ".." */
+static struct resources *
+rescgroup(const char *s)
+{
+	struct resources *res;
+	const char *p;
+
+	if (*s == '\0' || *s == '/')
+		goto bad;
+	for (p = s; p != NULL; p = strchr(p, '/')) {
+		if (*p == '/')
+			p++;
+		if (strncmp(p, "..", 2) == 0 && (p[2] == '/' || p[2] == '\0'))
+			goto bad;
+	}
+	if (!(res = newres(RES_CGROUP)))
+		return NULL;
+	res->cgroup = s;
+	return res;
+
+bad:
+	yyerror("invalid cgroup %s", s);
+	return NULL;
+}
+
+static const char *resnames[] = { "nice", "ioclass", "cpus", "cgroup" };
+
+/* Merge the settings of one option into those collected so far. */
+static int
+mergeres(struct resources **into, struct resources *from)
+{
+	struct resources *res = *into;
+	int i, j;
+
+	if (!res) {
+		*into = from;
+		return 0;
+	}
+	for (i = 0; i < 4; i++) {
+		if (res->set & from->set & (1 << i)) {
+			yyerror("can't have two %s settings", resnames[i]);
+			return -1;
+		}
+	}
+	for (i = 0; i < from->nrlimits; i++) {
+		for (j = 0; j < res->nrlimits; j++) {
+			if (res->rlimits[j].resource ==
+			    from->rlimits[i].resource) {
+				yyerror("can't have two rlimit %s settings",
+				    from->rlimits[i].name);
+				return -1;
+			}
+		}
+		if (res->nrlimits == RES_MAXRLIMITS) {
+			yyerror("too many rlimit settings");
+			return -1;
+		}
+		res->rlimits[res->nrlimits++] = from->rlimits[i];
+	}
+	if (from->set & RES_NICE)
+		res->nice = from->nice;
+	if (from->set & RES_IOCLASS) {
+		res->ioclass = from->ioclass;
+		res->iolevel = from->iolevel;
+	}
+	if (from->set & RES_CPUS) {
+		res->cpulist = from->cpulist;
+		memcpy(res->cpus, from->cpus, sizeof(res->cpus));
+	}
+	if (from->set & RES_CGROUP)
+		res->cgroup = from->cgroup;
+	res->set |= from->set;
+	free(from);
+	return 0;
+}
+
+static const struct keyword {
 	const char *word;
 	int token;
 } keywords[] = {
@@ -199,9 +661,14 @@ struct keyword {
 	{ "args", TARGS },
 	{ "nopass", TNOPASS },
 	{ "keepenv", TKEEPENV },
+	{ "nice", TNICE },
+	{ "rlimit", TRLIMIT },
+	{ "ioclass", TIOCLASS },
+	{ "cpus", TCPUS },
+	{ "cgroup", TCGROUP },
 };
 
-int
+static int
 yylex(void)
 {
 	char buf[1024], *ebuf, *p, *str;
@@ -287,8 +754,10 @@ repeat:
 			}
 		}
 		*p++ = c;
-		if (p == ebuf)
+		if (p == ebuf) {
 			yyerror("too long line");
+			return 0;
+		}
 		escape = 0;
 	}
 
@@ -314,8 +783,10 @@ eow:
 				return keywords[i].token;
 		}
 	}
-	if ((str = strdup(buf)) == NULL)
-		err(1, "strdup");
+	if ((str = strdup(buf)) == NULL) {
+		yyerror("can't allocate string");
+		return 0;
+	}
 	yylval.str = str;
 	return TSTRING;
 }
@@ -0,0 +1,969 @@
+/*
+ * Copyright (c) 2015 Ted Unangst <tedu@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+
+#include <errno.h>
+#include <grp.h>
+#include <limits.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "openbsd.h"
+
+#include "policy.h"
+#include "allocstats.h"
+
+size_t
+arraylen(const char **arr)
+{
+	size_t cnt = 0;
+
+	if (arr) {
+		while (*arr) {
+			cnt++;
+			arr++;
+		}
+	}
+	return cnt;
+}
+
+/* qsort() and bsearch() comparison of string pointers */
+int
+strpcmp(const void *a, const void *b)
+{
+	return strcmp(*(const char * const *)a, *(const char * const *)b);
+}
+
+/* FNV-1a, starting from FNV_INIT or a previous result */
+uint64_t
+fnvhash(uint64_t h, const void *p, size_t len)
+{
+	const unsigned char *s = p;
+
+	while (len--) {
+		h ^= *s++;
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+/*
+ * parseuid() and parsegid() may be called from several threads at once,
+ * so they use the reentrant lookups.
+ */
+int
+parseuid(const char *s, uid_t *uid)
+{
+	struct passwd pwstore, *pw;
+	char buf[1024];
+	const char *errstr;
+
+	if (getpwnam_r(s, &pwstore, buf, sizeof(buf), &pw) == 0 &&
+	    pw != NULL) {
+		*uid = pw->pw_uid;
+		return 0;
+	}
+	*uid = strtonum(s, 0, UID_MAX, &errstr);
+	if (errstr)
+		return -1;
+	return 0;
+}
+
+/*
+ * Names prefetched at load time.  Entries are sorted by kind and name.
+ * A name that was not resolved in time has done set to 0; it could be
+ * anybody, so a deny rule using it applies and a permit rule doesn't.
+ */
+#define UNRESOLVED	(-2)
+
+struct nameentry {
+	const char *name;
+	int group;
+	int ok;
+	int done;
+	id_t id;
+};
+
+struct nametable {
+	struct nameentry *entries;
+	int n;
+};
+
+static int
+nameentrycmp(const void *a, const void *b)
+{
+	const struct nameentry *na = a, *nb = b;
+
+	if (na->group != nb->group)
+		return na->group - nb->group;
+	return strcmp(na->name, nb->name);
+}
+
+static const struct nameentry *
+tablelookup(const struct nametable *t, const char *name, int group)
+{
+	struct nameentry key;
+
+	if (!t)
+		return NULL;
+	key.name = name;
+	key.group = group;
+	return bsearch(&key, t->entries, t->n, sizeof(*t->entries),
+	    nameentrycmp);
+}
+
+static int
+tableresult(const struct nameentry *e)
+{
+	if (e->ok)
+		return 0;
+	return e->done ? -1 : UNRESOLVED;
+}
+
+/* Returns 0, -1 for an unknown name or UNRESOLVED. */
+static int
+resolveuid(const struct policy *pol, const char *s, uid_t *uid)
+{
+	const struct nameentry *e;
+
+	if (pol->uidlookup && pol->uidlookup(s, uid) == 0)
+		return 0;
+	if ((e = tablelookup(pol->names, s, 0))) {
+		*uid = e->id;
+		return tableresult(e);
+	}
+	return parseuid(s, uid);
+}
+
+static int
+uidcheck(const struct policy *pol, const char *s, uid_t desired)
+{
+	uid_t uid;
+	int ret;
+
+	if ((ret = resolveuid(pol, s, &uid)) != 0)
+		return ret;
+	if (uid != desired)
+		return -1;
+	return 0;
+}
+
+int
+parsegid(const char *s, gid_t *gid)
+{
+	struct group grstore, *gr;
+	char sbuf[1024], *buf = sbuf, *nbuf;
+	size_t bufsz = sizeof(sbuf);
+	const char *errstr;
+	int ret;
+
+	/* group entries carry the member list and may be large */
+	while ((ret = getgrnam_r(s, &grstore, buf, bufsz, &gr)) == ERANGE &&
+	    bufsz < 1024 * 1024) {
+		bufsz *= 2;
+		if (!(nbuf = realloc(buf == sbuf ? NULL : buf, bufsz)))
+			break;
+		buf = nbuf;
+	}
+	if (ret == 0 && gr != NULL) {
+		*gid = gr->gr_gid;
+		if (buf != sbuf)
+			free(buf);
+		return 0;
+	}
+	if (buf != sbuf)
+		free(buf);
+	*gid = strtonum(s, 0, GID_MAX, &errstr);
+	if (errstr)
+		return -1;
+	return 0;
+}
+
+static int
+resolvegid(const struct policy *pol, const char *s, gid_t *gid)
+{
+	const struct nameentry *e;
+
+	if (pol->gidlookup && pol->gidlookup(s, gid) == 0)
+		return 0;
+	if ((e = tablelookup(pol->names, s, 1))) {
+		*gid = e->id;
+		return tableresult(e);
+	}
+	return parsegid(s, gid);
+}
+
+static int
+identcheck(const struct policy *pol, const char *ident, uid_t uid,
+    gid_t *groups, int ngroups)
+{
+	int i, ret;
+
+	if (ident[0] == ':') {
+		gid_t rgid;
+		if ((ret = resolvegid(pol, ident + 1, &rgid)) != 0)
+			return ret;
+		for (i = 0; i < ngroups; i++) {
+			if (rgid == groups[i])
+				return 0;
+		}
+		return -1;
+	}
+	return uidcheck(pol, ident, uid);
+}
+
+/* Does a name check with result ret let rule r apply? */
+static int
+applies(int ret, const struct rule *r)
+{
+	return ret == 0 || (ret == UNRESOLVED && r->action == DENY);
+}
+
+static int
+match(const struct policy *pol, uid_t uid, gid_t *groups, int ngroups,
+    uid_t target, const char *cmd, const char **cmdargs, const struct rule *r)
+{
+	int i;
+
+	/* identities and targets need lookups; commands are a search */
+	for (i = 0; i < r->ident.nnames; i++) {
+		if (applies(identcheck(pol, r->ident.names[i], uid, groups,
+		    ngroups), r))
+			break;
+	}
+	if (i == r->ident.nnames)
+		return 0;
+	if (r->target.nnames) {
+		for (i = 0; i < r->target.nnames; i++) {
+			if (applies(uidcheck(pol, r->target.names[i], target),
+			    r))
+				break;
+		}
+		if (i == r->target.nnames)
+			return 0;
+	}
+	if (r->cmd.nnames) {
+		if (!bsearch(&cmd, r->cmd.names, r->cmd.nnames,
+		    sizeof(*r->cmd.names), strpcmp))
+			return 0;
+		if (r->cmdargs) {
+			/* if arguments were given, they should match explicitly */
+			for (i = 0; r->cmdargs[i]; i++) {
+				if (!cmdargs[i])
+					return 0;
+				if (strcmp(r->cmdargs[i], cmdargs[i]))
+					return 0;
+			}
+			if (cmdargs[i])
+				return 0;
+		}
+	}
+	return 1;
+}
+
+int
+policy_permit(const struct policy *pol, uid_t uid, gid_t *groups, int ngroups,
+    const struct rule **lastr, uid_t target, const char *cmd,
+    const char **cmdargs)
+{
+	int i;
+
+	*lastr = NULL;
+	for (i = 0; i < pol->nrules; i++) {
+		if (match(pol, uid, groups, ngroups, target, cmd,
+		    cmdargs, pol->rules[i])) {
+			if (pol->matched)
+				pol->matched(pol->rules[i]);
+			*lastr = pol->rules[i];
+		}
+	}
+	if (!*lastr)
+		return 0;
+	return (*lastr)->action == PERMIT;
+}
+
+/*
+ * Listing expands every rule that applies to the caller into one grant
+ * per target and command.  A grant is shadowed by any later grant with
+ * the same or any target, the same or any command, and the same or any
+ * arguments.  Instead of comparing every pair, the grants are sorted by
+ * key and the last grant of each key is kept as an index; a grant is
+ * then checked against the few keys that could cover it.
+ */
+struct grantkey {
+	int anytarget;
+	uid_t target;
+	const char *cmd;	/* NULL for any command */
+	const char **args;	/* NULL for any arguments */
+};
+
+struct grant {
+	struct grantkey key;
+	const struct rule *rule;
+	int rulenum;
+	const char *target;
+	int alive;
+};
+
+/*
+ * Each identity and target is looked up once, however many rules use
+ * it; status is the result of identcheck() or resolveuid().
+ */
+struct namecache {
+	const char *name;
+	int status;
+	uid_t uid;
+};
+
+static int
+namecachecmp(const void *a, const void *b)
+{
+	return strcmp(((const struct namecache *)a)->name,
+	    ((const struct namecache *)b)->name);
+}
+
+static struct namecache *
+cachenames(const struct policy *pol, int target, uid_t uid, gid_t *groups,
+    int ngroups, int *np)
+{
+	struct namecache *cache = NULL, *nc;
+	int i, j, n = 0, u;
+
+	for (i = 0; i < pol->nrules; i++) {
+		const struct nameset *set = target ? &pol->rules[i]->target :
+		    &pol->rules[i]->ident;
+		if (!set->nnames)
+			continue;
+		if (!(nc = reallocarray(cache, n + set->nnames,
+		    sizeof(*cache)))) {
+			free(cache);
+			return NULL;
+		}
+		cache = nc;
+		for (j = 0; j < set->nnames; j++)
+			cache[n++].name = set->names[j];
+	}
+	if (n)
+		qsort(cache, n, sizeof(*cache), namecachecmp);
+	for (i = 0, u = 0; i < n; i++) {
+		if (u && strcmp(cache[u - 1].name, cache[i].name) == 0)
+			continue;
+		cache[u].name = cache[i].name;
+		if (target)
+			cache[u].status = resolveuid(pol, cache[u].name,
+			    &cache[u].uid);
+		else
+			cache[u].status = identcheck(pol, cache[u].name, uid,
+			    groups, ngroups);
+		u++;
+	}
+	*np = u;
+	if (!cache)
+		cache = calloc(1, sizeof(*cache));
+	return cache;
+}
+
+static const struct namecache *
+lookupname(const struct namecache *cache, int n, const char *name)
+{
+	struct namecache key;
+
+	key.name = name;
+	return bsearch(&key, cache, n, sizeof(*cache), namecachecmp);
+}
+
+static int
+argscmp(const char **a, const char **b)
+{
+	int r;
+
+	if (!a || !b)
+		return (a != NULL) - (b != NULL);
+	for (; *a && *b; a++, b++)
+		if ((r = strcmp(*a, *b)) != 0)
+			return r;
+	return (*a != NULL) - (*b != NULL);
+}
+
+static int
+keycmp(const struct grantkey *a, const struct grantkey *b)
+{
+	int r;
+
+	if (a->anytarget != b->anytarget)
+		return a->anytarget - b->anytarget;
+	if (!a->anytarget && a->target != b->target)
+		return a->target < b->target ? -1 : 1;
+	if (!a->cmd || !b->cmd) {
+		if (a->cmd || b->cmd)
+			return (a->cmd != NULL) - (b->cmd != NULL);
+	} else if ((r = strcmp(a->cmd, b->cmd)) != 0)
+		return r;
+	return argscmp(a->args, b->args);
+}
+
+static int
+grantcmp(const void *a, const void *b)
+{
+	const struct grant *ga = *(const struct grant * const *)a;
+	const struct grant *gb = *(const struct grant * const *)b;
+	int r;
+
+	if ((r = keycmp(&ga->key, &gb->key)) != 0)
+		return r;
+	return ga < gb ? -1 : ga > gb;
+}
+
+static int
+grantkeycmp(const void *a, const void *b)
+{
+	return keycmp(a, &(*(const struct grant * const *)b)->key);
+}
+
+/* Is g shadowed by the last grant with key k? */
+static int
+shadowed(struct grant **last, int nlast, const struct grant *g,
+    const struct grantkey *k)
+{
+	struct grant **found;
+
+	found = bsearch(k, last, nlast, sizeof(*last), grantkeycmp);
+	if (!found)
+		return 0;
+	if (keycmp(k, &g->key) == 0)
+		return *found != g;
+	return (*found)->rulenum > g->rulenum;
+}
+
+static int
+overlaps(const struct grant *a, const struct grant *b)
+{
+	if (!a->key.anytarget && !b->key.anytarget &&
+	    a->key.target != b->key.target)
+		return 0;
+	if (!a->key.cmd || !b->key.cmd)
+		return 1;
+	if (strcmp(a->key.cmd, b->key.cmd) != 0)
+		return 0;
+	return !a->key.args || !b->key.args ||
+	    argscmp(a->key.args, b->key.args) == 0;
+}
+
+/* Surviving permits by command, and by target; any sorts first. */
+static int
+bycmdcmp(const void *a, const void *b)
+{
+	const struct grant *ga = *(const struct grant * const *)a;
+	const struct grant *gb = *(const struct grant * const *)b;
+	int r;
+
+	if (!ga->key.cmd || !gb->key.cmd)
+		r = (ga->key.cmd != NULL) - (gb->key.cmd != NULL);
+	else
+		r = strcmp(ga->key.cmd, gb->key.cmd);
+	if (r != 0)
+		return r;
+	return ga->rulenum - gb->rulenum;
+}
+
+static int
+bytargetcmp(const void *a, const void *b)
+{
+	const struct grant *ga = *(const struct grant * const *)a;
+	const struct grant *gb = *(const struct grant * const *)b;
+
+	if (ga->key.anytarget != gb->key.anytarget)
+		return gb->key.anytarget - ga->key.anytarget;
+	if (!ga->key.anytarget && ga->key.target != gb->key.target)
+		return ga->key.target < gb->key.target ? -1 : 1;
+	return ga->rulenum - gb->rulenum;
+}
+
+static int
+lowerbound(struct grant **v, int n, const struct grant *key,
+    int (*cmp)(const void *, const void *))
+{
+	int lo = 0, hi = n, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (cmp(&v[mid], &key) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* Does the deny d take something away from an earlier surviving permit? */
+static int
+cutsinto(struct grant **bycmd, struct grant **bytarget, int n,
+    const struct grant *d)
+{
+	struct grant key;
+	int i;
+
+	/* permits of any command come first, one per target at most */
+	for (i = 0; i < n && !bycmd[i]->key.cmd; i++)
+		if (bycmd[i]->rulenum < d->rulenum && overlaps(bycmd[i], d))
+			return 1;
+	if (d->key.cmd) {
+		key = *d;
+		key.rulenum = -1;
+		for (i = lowerbound(bycmd, n, &key, bycmdcmp); i < n &&
+		    strcmp(bycmd[i]->key.cmd, d->key.cmd) == 0 &&
+		    bycmd[i]->rulenum < d->rulenum; i++)
+			if (overlaps(bycmd[i], d))
+				return 1;
+		return 0;
+	}
+	/* a deny of every command: the earliest permit for its target */
+	if (d->key.anytarget) {
+		for (i = 0; i < n; i++)
+			if (bytarget[i]->rulenum < d->rulenum)
+				return 1;
+		return 0;
+	}
+	if (n && bytarget[0]->key.anytarget &&
+	    bytarget[0]->rulenum < d->rulenum)
+		return 1;
+	key = *d;
+	key.rulenum = -1;
+	i = lowerbound(bytarget, n, &key, bytargetcmp);
+	return i < n && !bytarget[i]->key.anytarget &&
+	    bytarget[i]->key.target == d->key.target &&
+	    bytarget[i]->rulenum < d->rulenum;
+}
+
+/*
+ * Call fn for every grant that survives last match semantics, in rule
+ * order.  target and cmd are NULL when the rule allows any; the command
+ * arguments are those of the rule.  A deny is only reported where it
+ * cuts into an earlier permit.
+ */
+int
+policy_list(const struct policy *pol, uid_t uid, gid_t *groups, int ngroups,
+    void (*fn)(const struct rule *, const char *, const char *, void *),
+    void *arg)
+{
+	struct namecache *idents, *targets;
+	struct grant *grants = NULL, *ng, **last = NULL;
+	struct grant **bycmd = NULL, **bytarget = NULL;
+	int nidents, ntargets, ngrants = 0, nlast = 0, npermits = 0;
+	int i, j, t, c, ret = -1;
+
+	if (!(idents = cachenames(pol, 0, uid, groups, ngroups, &nidents)))
+		return -1;
+	if (!(targets = cachenames(pol, 1, uid, groups, ngroups,
+	    &ntargets))) {
+		free(idents);
+		return -1;
+	}
+
+	for (i = 0; i < pol->nrules; i++) {
+		const struct rule *r = pol->rules[i];
+		int nt = r->target.nnames ? r->target.nnames : 1;
+		int nc = r->cmd.nnames ? r->cmd.nnames : 1;
+
+		for (j = 0; j < r->ident.nnames; j++)
+			if (applies(lookupname(idents, nidents,
+			    r->ident.names[j])->status, r))
+				break;
+		if (j == r->ident.nnames)
+			continue;
+		if (!(ng = reallocarray(grants, ngrants + nt * nc,
+		    sizeof(*grants))))
+			goto done;
+		grants = ng;
+		for (t = 0; t < nt; t++) {
+			const struct namecache *tc = NULL;
+			if (r->target.nnames) {
+				tc = lookupname(targets, ntargets,
+				    r->target.names[t]);
+				if (!applies(tc->status, r))
+					continue;
+			}
+			for (c = 0; c < nc; c++) {
+				struct grant *g = &grants[ngrants++];
+				/* an unresolved target may be any of them */
+				g->key.anytarget = tc == NULL ||
+				    tc->status == UNRESOLVED;
+				g->key.target = g->key.anytarget ? 0 : tc->uid;
+				g->key.cmd = r->cmd.nnames ?
+				    r->cmd.names[c] : NULL;
+				g->key.args = g->key.cmd ? r->cmdargs : NULL;
+				g->rule = r;
+				g->rulenum = i;
+				g->target = tc ? tc->name : NULL;
+			}
+		}
+	}
+
+	/* the index: the last grant of each key */
+	if (ngrants && !(last = reallocarray(NULL, ngrants, sizeof(*last))))
+		goto done;
+	for (i = 0; i < ngrants; i++)
+		last[i] = &grants[i];
+	if (ngrants)
+		qsort(last, ngrants, sizeof(*last), grantcmp);
+	for (i = 0; i < ngrants; i++) {
+		if (nlast && keycmp(&last[nlast - 1]->key, &last[i]->key) == 0)
+			last[nlast - 1] = last[i];
+		else
+			last[nlast++] = last[i];
+	}
+
+	for (i = 0; i < ngrants; i++) {
+		struct grant *g = &grants[i];
+		struct grantkey k[2][3];
+		int nk = 0;
+
+		for (t = 0; t < 2; t++) {
+			if (t == 1 && g->key.anytarget)
+				break;
+			for (c = 0; c < 3; c++) {
+				k[t][c] = g->key;
+				if (t == 1)
+					k[t][c].anytarget = 1;
+			}
+			if (g->key.cmd) {
+				/* any arguments, then any command */
+				k[t][1].args = NULL;
+				k[t][2].cmd = NULL;
+				k[t][2].args = NULL;
+			}
+			nk = t + 1;
+		}
+		g->alive = 1;
+		for (t = 0; t < nk && g->alive; t++)
+			for (c = 0; c < 3 && g->alive; c++)
+				if (shadowed(last, nlast, g, &k[t][c]))
+					g->alive = 0;
+	}
+
+	if (ngrants && (!(bycmd = reallocarray(NULL, ngrants,
+	    sizeof(*bycmd))) || !(bytarget = reallocarray(NULL, ngrants,
+	    sizeof(*bytarget)))))
+		goto done;
+	for (i = 0; i < ngrants; i++) {
+		if (grants[i].alive && grants[i].rule->action == PERMIT) {
+			bycmd[npermits] = bytarget[npermits] = &grants[i];
+			npermits++;
+		}
+	}
+	if (npermits) {
+		qsort(bycmd, npermits, sizeof(*bycmd), bycmdcmp);
+		qsort(bytarget, npermits, sizeof(*bytarget), bytargetcmp);
+	}
+
+	for (i = 0; i < ngrants; i++) {
+		struct grant *g = &grants[i];
+		if (!g->alive)
+			continue;
+		if (g->rule->action == DENY &&
+		    !cutsinto(bycmd, bytarget, npermits, g))
+			continue;
+		fn(g->rule, g->target, g->key.cmd, arg);
+	}
+	ret = 0;
+
+done:
+	free(bytarget);
+	free(bycmd);
+	free(last);
+	free(grants);
+	free(targets);
+	free(idents);
+	return ret;
+}
+
+/*
+ * Prefetching resolves the names of a policy on a few threads, which
+ * may still be blocked in NSS when the deadline passes.  They work on
+ * their own copy of the names and the last one out frees it, so the
+ * policy never waits for them.
+ */
+struct prefetchjob {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int refs;
+	int next, ndone, n;
+	struct nameentry *entries;
+};
+
+static void
+releasejob(struct prefetchjob *job)
+{
+	int i, last;
+
+	pthread_mutex_lock(&job->lock);
+	last = --job->refs == 0;
+	pthread_mutex_unlock(&job->lock);
+	if (!last)
+		return;
+	for (i = 0; i < job->n; i++)
+		free((char *)job->entries[i].name);
+	free(job->entries);
+	pthread_mutex_destroy(&job->lock);
+	pthread_cond_destroy(&job->cond);
+	free(job);
+}
+
+static void *
+prefetchworker(void *arg)
+{
+	struct prefetchjob *job = arg;
+	struct nameentry *e;
+	uid_t uid;
+	gid_t gid;
+	int ok;
+
+	pthread_mutex_lock(&job->lock);
+	while (job->next < job->n) {
+		e = &job->entries[job->next++];
+		pthread_mutex_unlock(&job->lock);
+		if (e->group) {
+			ok = parsegid(e->name, &gid) == 0;
+			uid = gid;
+		} else
+			ok = parseuid(e->name, &uid) == 0;
+		pthread_mutex_lock(&job->lock);
+		e->ok = ok;
+		e->id = uid;
+		e->done = 1;
+		if (++job->ndone == job->n)
+			pthread_cond_signal(&job->cond);
+	}
+	pthread_mutex_unlock(&job->lock);
+	releasejob(job);
+	return NULL;
+}
+
+static int
+addentry(struct nameentry **entries, int *n, int *max, const char *name,
+    int group)
+{
+	struct nameentry *ne;
+
+	if (*n == *max) {
+		int nmax = *max ? *max * 2 : 64;
+		if (!(ne = reallocarray(*entries, nmax, sizeof(*ne))))
+			return -1;
+		*entries = ne;
+		*max = nmax;
+	}
+	memset(&(*entries)[*n], 0, sizeof(**entries));
+	(*entries)[*n].name = name;
+	(*entries)[(*n)++].group = group;
+	return 0;
+}
+
+static int
+collectnames(const struct policy *pol, struct nameentry **entries, int *np)
+{
+	struct nameentry *e = NULL;
+	uid_t uid;
+	gid_t gid;
+	int i, j, n = 0, max = 0, u;
+
+	for (i = 0; i < pol->nrules; i++) {
+		const struct rule *r = pol->rules[i];
+		for (j = 0; j < r->ident.nnames; j++) {
+			const char *name = r->ident.names[j];
+			int group = name[0] == ':';
+			if (addentry(&e, &n, &max, name + group, group) == -1)
+				goto fail;
+		}
+		for (j = 0; j < r->target.nnames; j++)
+			if (addentry(&e, &n, &max, r->target.names[j],
+			    0) == -1)
+				goto fail;
+	}
+	if (n)
+		qsort(e, n, sizeof(*e), nameentrycmp);
+	/* only what the lookup hooks can't answer is worth a thread */
+	for (i = 0, u = 0; i < n; i++) {
+		if (u && nameentrycmp(&e[u - 1], &e[i]) == 0)
+			continue;
+		if (e[i].group ? pol->gidlookup &&
+		    pol->gidlookup(e[i].name, &gid) == 0 :
+		    pol->uidlookup && pol->uidlookup(e[i].name, &uid) == 0)
+			continue;
+		e[u++] = e[i];
+	}
+	*entries = e;
+	*np = u;
+	return 0;
+
+fail:
+	free(e);
+	return -1;
+}
+
+/*
+ * Resolve every identity and target of the policy concurrently, on up
+ * to nthreads threads, waiting at most timeout milliseconds.  Later
+ * evaluation takes the names from the results; a name that was not
+ * resolved in time makes deny rules using it apply and permit rules
+ * using it not apply.  Returns the number of such names, or -1 if the
+ * lookups can't be started, in which case names are resolved as they
+ * are needed.
+ */
+int
+policy_prefetch(struct policy *pol, int nthreads, int timeout)
+{
+	struct nametable *t;
+	struct prefetchjob *job = NULL;
+	struct nameentry *e;
+	struct timespec deadline;
+	pthread_attr_t attr;
+	pthread_t thread;
+	int i, n, started = 0, late = 0;
+
+	if (pol->names || collectnames(pol, &e, &n) == -1)
+		return -1;
+	if (!n) {
+		free(e);
+		return 0;
+	}
+	if (!(t = calloc(1, sizeof(*t))) || !(job = calloc(1, sizeof(*job))) ||
+	    !(job->entries = calloc(n, sizeof(*job->entries)))) {
+		if (t)
+			free(job);
+		free(t);
+		free(e);
+		return -1;
+	}
+	t->entries = e;
+	t->n = n;
+	pthread_mutex_init(&job->lock, NULL);
+	pthread_cond_init(&job->cond, NULL);
+	job->n = n;
+	job->refs = 1;
+	for (i = 0; i < n; i++) {
+		job->entries[i].group = e[i].group;
+		if (!(job->entries[i].name = strdup(e[i].name)))
+			goto fail;
+	}
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (nthreads > n)
+		nthreads = n;
+	for (i = 0; i < nthreads; i++) {
+		pthread_mutex_lock(&job->lock);
+		job->refs++;
+		pthread_mutex_unlock(&job->lock);
+		if (pthread_create(&thread, &attr, prefetchworker, job) != 0) {
+			releasejob(job);
+			break;
+		}
+		started++;
+	}
+	pthread_attr_destroy(&attr);
+	if (!started)
+		goto fail;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += timeout / 1000;
+	deadline.tv_nsec += (long)(timeout % 1000) * 1000000;
+	if (deadline.tv_nsec >= 1000000000) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+	pthread_mutex_lock(&job->lock);
+	while (job->ndone < job->n)
+		if (pthread_cond_timedwait(&job->cond, &job->lock,
+		    &deadline) == ETIMEDOUT)
+			break;
+	for (i = 0; i < n; i++) {
+		e[i].done = job->entries[i].done;
+		e[i].ok = e[i].done && job->entries[i].ok;
+		e[i].id = job->entries[i].id;
+		late += !e[i].done;
+	}
+	pthread_mutex_unlock(&job->lock);
+	releasejob(job);
+	pol->names = t;
+	return late;
+
+fail:
+	releasejob(job);
+	free(t->entries);
+	free(t);
+	return -1;
+}
+
+/* Call fn on each name that policy_prefetch() did not resolve in time. */
+void
+policy_unresolved(const struct policy *pol,
+    void (*fn)(const char *, int, void *), void *arg)
+{
+	int i;
+
+	if (!pol->names)
+		return;
+	for (i = 0; i < pol->names->n; i++)
+		if (!pol->names->entries[i].done)
+			fn(pol->names->entries[i].name,
+			    pol->names->entries[i].group, arg);
+}
+
+static void
+freelist(const char **list)
+{
+	size_t i;
+
+	if (!list)
+		return;
+	for (i = 0; list[i]; i++)
+		free((char *)list[i]);
+	free(list);
+}
+
+void
+policy_free(struct policy *pol)
+{
+	int i;
+
+	if (!pol)
+		return;
+	for (i = 0; i < pol->nrules; i++) {
+		struct rule *r = pol->rules[i];
+		freelist(r->ident.names);
+		freelist(r->target.names);
+		freelist(r->cmd.names);
+		freelist(r->cmdargs);
+		freelist(r->envlist);
+		if (r->res) {
+			free((char *)r->res->cpulist);
+			free((char *)r->res->cgroup);
+			free(r->res);
+		}
+		free(r);
+	}
+	if (pol->names) {
+		free(pol->names->entries);
+		free(pol->names);
+	}
+	free(pol->rules);
+	free(pol->errors);
+	free(pol);
+}
@@ -0,0 +1,141 @@
+/*
+ * Copyright (c) 2016 Nathan Holstein <nathan.holstein@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _DOAS_POLICY_H_
+#define _DOAS_POLICY_H_
+
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * libdoaspolicy: the doas.conf parser and rule evaluation.
+ *
+ * policy_parse() never exits; syntax and allocation errors are counted
+ * in nerrors and their messages collected in errors.  Parsing is
+ * serialized internally, so any number of threads may parse at once.
+ * A parsed policy is never modified by evaluation and may be shared
+ * by concurrent policy_permit() callers.
+ *
+ * policy_prefetch() resolves all names of a policy up front, in parallel
+ * and with a deadline, instead of one at a time during evaluation.  A
+ * name still unresolved at the deadline may be anybody: deny rules
+ * using it apply, permit rules using it don't.  policy_unresolved()
+ * tells which names those were.
+ *
+ * policy_list() walks what a caller may run, once per target and
+ * command, with later rules applied to earlier ones.
+ *
+ * strpcmp() compares string pointers for qsort() and bsearch(), and
+ * fnvhash() is the FNV-1a hash doas uses to identify configs and
+ * requests.
+ *
+ * Link with libdoaspolicy.a and libopenbsd.a.
+ */
+
+#define RES_NICE	0x1
+#define RES_IOCLASS	0x2
+#define RES_CPUS	0x4
+#define RES_CGROUP	0x8
+
+#define RES_MAXRLIMITS	16
+#define RES_MAXCPUS	1024
+
+/*
+ * Scheduling and resource settings of a permit rule, already validated
+ * by the parser.  set tells which of the single valued settings are in
+ * use.
+ */
+struct resources {
+	int set;
+	int nice;
+	int ioclass;
+	int iolevel;
+	const char *cpulist;
+	uint64_t cpus[RES_MAXCPUS / 64];
+	const char *cgroup;
+	int nrlimits;
+	struct {
+		const char *name;
+		int resource;
+		rlim_t value;
+	} rlimits[RES_MAXRLIMITS];
+};
+
+/*
+ * The identities, targets or commands of a rule, sorted and without
+ * duplicates.  An empty target or command set matches anything.
+ */
+struct nameset {
+	const char **names;
+	int nnames;
+};
+
+struct rule {
+	int action;
+	int options;
+	struct nameset ident;
+	struct nameset target;
+	struct nameset cmd;
+	const char **cmdargs;
+	const char **envlist;
+	struct resources *res;
+	int lineno;
+};
+
+struct nametable;
+
+struct policy {
+	struct rule **rules;
+	int nrules, maxrules;
+	int nerrors;
+	char *errors;
+	/* called for every matching rule, if set */
+	void (*matched)(const struct rule *);
+	/* tried before the system databases to resolve names, if set */
+	int (*uidlookup)(const char *, uid_t *);
+	int (*gidlookup)(const char *, gid_t *);
+	/* names resolved by policy_prefetch() */
+	struct nametable *names;
+};
+
+#define PERMIT	1
+#define DENY	2
+
+#define NOPASS		0x1
+#define KEEPENV		0x2
+
+struct policy *policy_parse(FILE *);
+void policy_free(struct policy *);
+int policy_permit(const struct policy *, uid_t, gid_t *, int,
+    const struct rule **, uid_t, const char *, const char **);
+int policy_prefetch(struct policy *, int, int);
+void policy_unresolved(const struct policy *,
+    void (*)(const char *, int, void *), void *);
+int policy_list(const struct policy *, uid_t, gid_t *, int,
+    void (*)(const struct rule *, const char *, const char *, void *),
+    void *);
+
+int parseuid(const char *, uid_t *);
+int parsegid(const char *, gid_t *);
+size_t arraylen(const char **);
+int strpcmp(const void *, const void *);
+
+#define FNV_INIT	0xcbf29ce484222325ULL
+uint64_t fnvhash(uint64_t, const void *, size_t);
+
+#endif
@@ -0,0 +1,232 @@
+/*
+ * Copyright (c) 2016 Nathan Holstein <nathan.holstein@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * load [-m] [-c concurrency] [-l labels] [-n count] command [args]
+ *
+ * Run command count times, from concurrency processes at once, and
+ * measure the time from fork() until the program at the end of the
+ * chain gets control.  command is expected to end up running stamp,
+ * which prints that moment.  Prints the 50th, 99th and 99.9th
+ * percentiles of that time in microseconds, the runs per second and
+ * the number of failed runs, in the Prometheus text format with the
+ * given labels added.
+ *
+ * With -m, command is a doas built with -DMAINSTAMP, and the time from
+ * its execve() until its main() is reported too: the child writes the
+ * first moment to a pipe named by DOAS_MAINSTAMP, doas the second.
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static int mflag;
+
+static void __attribute__((__noreturn__))
+usage(void)
+{
+	fprintf(stderr, "usage: load [-m] [-c concurrency] [-l labels] "
+	    "[-n count] command [args]\n");
+	exit(1);
+}
+
+static int64_t
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Read fd to the end into buf, of size len, and close it. */
+static void
+readall(int fd, char *buf, size_t len)
+{
+	ssize_t n;
+	size_t off = 0;
+
+	while ((n = read(fd, buf + off, len - 1 - off)) > 0)
+		off += n;
+	buf[off] = '\0';
+	close(fd);
+}
+
+/*
+ * Run argv once; returns the nanoseconds until stamp ran, or -1.  With
+ * -m, *tomain is set to the nanoseconds from execve() to main().
+ */
+static int64_t
+run(char **argv, int64_t *tomain)
+{
+	char buf[64], mbuf[64], fd[16];
+	long long stamp, exec, entry;
+	int64_t start;
+	pid_t pid;
+	int fds[2], mfds[2], status;
+
+	if (pipe(fds) == -1 || (mflag && pipe(mfds) == -1))
+		err(1, "pipe");
+	start = now();
+	switch ((pid = fork())) {
+	case -1:
+		err(1, "fork");
+	case 0:
+		close(fds[0]);
+		if (dup2(fds[1], STDOUT_FILENO) == -1)
+			_exit(1);
+		if (mflag) {
+			close(mfds[0]);
+			snprintf(fd, sizeof(fd), "%d", mfds[1]);
+			if (setenv("DOAS_MAINSTAMP", fd, 1) == -1)
+				_exit(1);
+			dprintf(mfds[1], "%lld\n", (long long)now());
+		}
+		execvp(argv[0], argv);
+		_exit(1);
+	}
+	close(fds[1]);
+	if (mflag)
+		close(mfds[1]);
+	readall(fds[0], buf, sizeof(buf));
+	if (mflag)
+		readall(mfds[0], mbuf, sizeof(mbuf));
+	if (waitpid(pid, &status, 0) == -1)
+		err(1, "waitpid");
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0 ||
+	    sscanf(buf, "%lld", &stamp) != 1 || stamp < start)
+		return -1;
+	if (mflag) {
+		if (sscanf(mbuf, "%lld %lld", &exec, &entry) != 2 ||
+		    entry < exec)
+			return -1;
+		*tomain = entry - exec;
+	}
+	return stamp - start;
+}
+
+static int
+cmp(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void
+report(const char *name, int64_t *times, size_t ntimes, int concurrency,
+    const char *sep, const char *labels)
+{
+	const double quantiles[] = { 0.5, 0.99, 0.999 };
+	int64_t t;
+	size_t i;
+
+	qsort(times, ntimes, sizeof(*times), cmp);
+	for (i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++) {
+		t = ntimes ? times[(size_t)(quantiles[i] * (ntimes - 1))] : 0;
+		printf("doas_load_%s_microseconds{concurrency=\"%d\"%s%s,"
+		    "quantile=\"%g\"} %.0f\n", name, concurrency, sep, labels,
+		    quantiles[i], t / 1e3);
+	}
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *labels = "";
+	int64_t *times, *tomain, t[2], start, elapsed;
+	size_t i, ntimes = 0, failed = 0;
+	int concurrency = 1, count = 1000, ch, w, fds[2];
+	char sep[2] = "";
+
+	while ((ch = getopt(argc, argv, "+c:l:mn:")) != -1) {
+		switch (ch) {
+		case 'c':
+			if ((concurrency = atoi(optarg)) < 1)
+				errx(1, "invalid concurrency");
+			break;
+		case 'l':
+			labels = optarg;
+			sep[0] = ',';
+			break;
+		case 'm':
+			mflag = 1;
+			break;
+		case 'n':
+			if ((count = atoi(optarg)) < 1)
+				errx(1, "invalid count");
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc == 0)
+		usage();
+
+	if (!(times = calloc(count, sizeof(*times))) ||
+	    !(tomain = calloc(count, sizeof(*tomain))))
+		err(1, "calloc");
+	if (pipe(fds) == -1)
+		err(1, "pipe");
+
+	/* each worker sends the times of every run, -1 if it failed */
+	start = now();
+	for (w = 0; w < concurrency; w++) {
+		switch (fork()) {
+		case -1:
+			err(1, "fork");
+		case 0:
+			close(fds[0]);
+			for (i = w; i < (size_t)count; i += concurrency) {
+				t[0] = run(argv, &t[1]);
+				if (write(fds[1], t, sizeof(t)) != sizeof(t))
+					_exit(1);
+			}
+			_exit(0);
+		}
+	}
+	close(fds[1]);
+	while (read(fds[0], t, sizeof(t)) == sizeof(t)) {
+		if (t[0] < 0)
+			failed++;
+		else {
+			tomain[ntimes] = t[1];
+			times[ntimes++] = t[0];
+		}
+	}
+	while (wait(NULL) != -1)
+		;
+	elapsed = now() - start;
+
+	report("exec", times, ntimes, concurrency, sep, labels);
+	if (mflag)
+		report("main", tomain, ntimes, concurrency, sep, labels);
+	printf("doas_load_runs_per_second{concurrency=\"%d\"%s%s} %.0f\n",
+	    concurrency, sep, labels, (ntimes + failed) / (elapsed / 1e9));
+	printf("doas_load_failures_total{concurrency=\"%d\"%s%s} %zu\n",
+	    concurrency, sep, labels, failed);
+	return failed != 0;
+}
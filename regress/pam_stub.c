@@ -0,0 +1,121 @@
+/*
+ * Copyright (c) 2016 Nathan Holstein <nathan.holstein@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * A PAM module for the regress tests, so that authentication can be
+ * exercised without real accounts.  Its arguments in the service file:
+ *
+ *	prompts=n	ask for a password n times, default 1
+ *	password=s	the answer expected to every prompt, default "secret"
+ *	info=s		show the message s first
+ *	delay=ms	wait this long before answering
+ *	fail		fail even if every answer was right
+ */
+
+#define PAM_SM_AUTH
+
+#include <sys/types.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <security/pam_appl.h>
+#include <security/pam_modules.h>
+
+static int
+converse(const struct pam_conv *conv, int style, const char *msg,
+    char **answer)
+{
+	struct pam_message m, *mp = &m;
+	struct pam_response *r = NULL;
+	int ret;
+
+	m.msg_style = style;
+	m.msg = (char *)msg;
+	ret = conv->conv(1, (const struct pam_message **)&mp, &r,
+	    conv->appdata_ptr);
+	if (ret != PAM_SUCCESS)
+		return ret;
+	if (answer)
+		*answer = r ? r->resp : NULL;
+	else if (r)
+		free(r->resp);
+	free(r);
+	return PAM_SUCCESS;
+}
+
+PAM_EXTERN int
+pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc,
+    const char **argv)
+{
+	const struct pam_conv *conv;
+	const char *password = "secret", *info = NULL;
+	struct timespec ts;
+	char prompt[32], *answer;
+	long delay = 0;
+	int i, prompts = 1, fail = 0, ok = 1, ret;
+
+	(void)flags;
+	for (i = 0; i < argc; i++) {
+		if (strncmp(argv[i], "prompts=", 8) == 0)
+			prompts = atoi(argv[i] + 8);
+		else if (strncmp(argv[i], "password=", 9) == 0)
+			password = argv[i] + 9;
+		else if (strncmp(argv[i], "info=", 5) == 0)
+			info = argv[i] + 5;
+		else if (strncmp(argv[i], "delay=", 6) == 0)
+			delay = atol(argv[i] + 6);
+		else if (strcmp(argv[i], "fail") == 0)
+			fail = 1;
+		else
+			return PAM_SERVICE_ERR;
+	}
+	if (pam_get_item(pamh, PAM_CONV, (const void **)&conv) != PAM_SUCCESS ||
+	    !conv || !conv->conv)
+		return PAM_SERVICE_ERR;
+
+	if (info && (ret = converse(conv, PAM_TEXT_INFO, info,
+	    NULL)) != PAM_SUCCESS)
+		return ret;
+	for (i = 0; i < prompts; i++) {
+		snprintf(prompt, sizeof(prompt), "Token %d: ", i + 1);
+		if ((ret = converse(conv, PAM_PROMPT_ECHO_OFF,
+		    i ? prompt : "Password: ", &answer)) != PAM_SUCCESS)
+			return ret;
+		if (!answer || strcmp(answer, password) != 0)
+			ok = 0;
+		free(answer);
+	}
+	if (delay > 0) {
+		ts.tv_sec = delay / 1000;
+		ts.tv_nsec = (delay % 1000) * 1000000;
+		while (nanosleep(&ts, &ts) == -1)
+			;
+	}
+	return ok && !fail ? PAM_SUCCESS : PAM_AUTH_ERR;
+}
+
+PAM_EXTERN int
+pam_sm_setcred(pam_handle_t *pamh, int flags, int argc, const char **argv)
+{
+	(void)pamh;
+	(void)flags;
+	(void)argc;
+	(void)argv;
+	return PAM_SUCCESS;
+}
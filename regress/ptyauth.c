@@ -0,0 +1,121 @@
+/*
+ * Copyright (c) 2016 Nathan Holstein <nathan.holstein@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * ptyauth [-n count] [-p password] [-s status] command [args]
+ *
+ * Run command count times on a new pseudo terminal, the way a user at
+ * a terminal would, and answer every prompt (output ending in ": ")
+ * with the password.  Fails unless every run exits with status, 0 by
+ * default.  Prints the mean wall clock time of a run in microseconds.
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <err.h>
+#include <errno.h>
+#include <pty.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static void __attribute__((__noreturn__))
+usage(void)
+{
+	fprintf(stderr, "usage: ptyauth [-n count] [-p password] [-s status] "
+	    "command [args]\n");
+	exit(1);
+}
+
+/* Run argv once, answering its prompts; returns its exit status. */
+static int
+run(char **argv, const char *password)
+{
+	char buf[256], tail[2] = { 0, 0 };
+	ssize_t n, i;
+	pid_t pid;
+	int fd, status;
+
+	switch ((pid = forkpty(&fd, NULL, NULL, NULL))) {
+	case -1:
+		err(1, "forkpty");
+	case 0:
+		execvp(argv[0], argv);
+		warn("%s", argv[0]);
+		_exit(127);
+	}
+	/* on Linux, reading the master fails with EIO once the child is gone */
+	while ((n = read(fd, buf, sizeof(buf))) > 0 || (n == -1 &&
+	    errno == EINTR)) {
+		for (i = 0; i < n; i++) {
+			tail[0] = tail[1];
+			tail[1] = buf[i];
+		}
+		if (tail[0] == ':' && tail[1] == ' ') {
+			if (write(fd, password, strlen(password)) == -1 ||
+			    write(fd, "\n", 1) == -1)
+				err(1, "write");
+			tail[0] = tail[1] = 0;
+		}
+	}
+	close(fd);
+	if (waitpid(pid, &status, 0) == -1)
+		err(1, "waitpid");
+	return WIFEXITED(status) ? WEXITSTATUS(status) : 128;
+}
+
+int
+main(int argc, char **argv)
+{
+	struct timespec start, end;
+	const char *password = "secret";
+	long long count = 1, i;
+	int ch, status, want = 0;
+
+	while ((ch = getopt(argc, argv, "+n:p:s:")) != -1) {
+		switch (ch) {
+		case 'n':
+			if ((count = strtoll(optarg, NULL, 10)) < 1)
+				errx(1, "invalid count");
+			break;
+		case 'p':
+			password = optarg;
+			break;
+		case 's':
+			want = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc == 0)
+		usage();
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < count; i++)
+		if ((status = run(argv, password)) != want)
+			errx(1, "%s exited with %d, expected %d", argv[0],
+			    status, want);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	printf("%.0f\n", ((end.tv_sec - start.tv_sec) * 1e9 +
+	    (end.tv_nsec - start.tv_nsec)) / 1e3 / count);
+	return 0;
+}
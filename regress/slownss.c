@@ -0,0 +1,200 @@
+/*
+ * Copyright (c) 2016 Nathan Holstein <nathan.holstein@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * A stand-in for a remote user directory: preloaded into doas, it
+ * delays every user and group lookup by NSS_DELAY milliseconds before
+ * answering from the local databases.  NSS_USER=name:uid adds a user
+ * that is in the directory only, with a group of the same id.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE	/* RTLD_NEXT */
+#endif
+
+#include <sys/types.h>
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <grp.h>
+#include <pwd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static void
+slow(void)
+{
+	struct timespec ts;
+	const char *s;
+	long ms = 2;
+
+	if ((s = getenv("NSS_DELAY")))
+		ms = strtol(s, NULL, 10);
+	ts.tv_sec = ms / 1000;
+	ts.tv_nsec = (ms % 1000) * 1000000;
+	while (nanosleep(&ts, &ts) == -1)
+		;
+}
+
+/* The NSS_USER entry if it has the name, or the uid if name is NULL. */
+static struct passwd *
+extra(const char *name, uid_t uid)
+{
+	static char buf[64];
+	static struct passwd pw;
+	const char *s;
+	char *p;
+
+	if (!(s = getenv("NSS_USER")) || strlen(s) >= sizeof(buf))
+		return NULL;
+	strcpy(buf, s);
+	if (!(p = strchr(buf, ':')))
+		return NULL;
+	*p++ = '\0';
+	pw.pw_name = buf;
+	pw.pw_passwd = "*";
+	pw.pw_uid = pw.pw_gid = strtoul(p, NULL, 10);
+	pw.pw_gecos = "";
+	pw.pw_dir = "/";
+	pw.pw_shell = "/bin/sh";
+	if (name ? strcmp(name, pw.pw_name) != 0 : uid != pw.pw_uid)
+		return NULL;
+	return &pw;
+}
+
+/* Copy the NSS_USER entry like getpwnam_r() would. */
+static int
+extra_r(struct passwd *found, struct passwd *pw, char *buf, size_t len,
+    struct passwd **res)
+{
+	size_t n = strlen(found->pw_name) + 1;
+
+	if (n > len)
+		return ERANGE;
+	*pw = *found;
+	pw->pw_name = memcpy(buf, found->pw_name, n);
+	*res = pw;
+	return 0;
+}
+
+struct passwd *
+getpwnam(const char *name)
+{
+	struct passwd *(*real)(const char *);
+	struct passwd *found;
+
+	slow();
+	if ((found = extra(name, 0)))
+		return found;
+	*(void **)&real = dlsym(RTLD_NEXT, "getpwnam");
+	return real(name);
+}
+
+struct passwd *
+getpwuid(uid_t uid)
+{
+	struct passwd *(*real)(uid_t);
+	struct passwd *found;
+
+	slow();
+	if ((found = extra(NULL, uid)))
+		return found;
+	*(void **)&real = dlsym(RTLD_NEXT, "getpwuid");
+	return real(uid);
+}
+
+int
+getpwnam_r(const char *name, struct passwd *pw, char *buf, size_t len,
+    struct passwd **res)
+{
+	int (*real)(const char *, struct passwd *, char *, size_t,
+	    struct passwd **);
+	struct passwd *found;
+
+	slow();
+	if ((found = extra(name, 0)))
+		return extra_r(found, pw, buf, len, res);
+	*(void **)&real = dlsym(RTLD_NEXT, "getpwnam_r");
+	return real(name, pw, buf, len, res);
+}
+
+int
+getpwuid_r(uid_t uid, struct passwd *pw, char *buf, size_t len,
+    struct passwd **res)
+{
+	int (*real)(uid_t, struct passwd *, char *, size_t,
+	    struct passwd **);
+	struct passwd *found;
+
+	slow();
+	if ((found = extra(NULL, uid)))
+		return extra_r(found, pw, buf, len, res);
+	*(void **)&real = dlsym(RTLD_NEXT, "getpwuid_r");
+	return real(uid, pw, buf, len, res);
+}
+
+struct group *
+getgrnam(const char *name)
+{
+	struct group *(*real)(const char *);
+
+	slow();
+	*(void **)&real = dlsym(RTLD_NEXT, "getgrnam");
+	return real(name);
+}
+
+struct group *
+getgrgid(gid_t gid)
+{
+	struct group *(*real)(gid_t);
+
+	slow();
+	*(void **)&real = dlsym(RTLD_NEXT, "getgrgid");
+	return real(gid);
+}
+
+int
+getgrnam_r(const char *name, struct group *gr, char *buf, size_t len,
+    struct group **res)
+{
+	int (*real)(const char *, struct group *, char *, size_t,
+	    struct group **);
+
+	slow();
+	*(void **)&real = dlsym(RTLD_NEXT, "getgrnam_r");
+	return real(name, gr, buf, len, res);
+}
+
+int
+getgrouplist(const char *name, gid_t gid, gid_t *groups, int *ngroups)
+{
+	int (*real)(const char *, gid_t, gid_t *, int *);
+
+	slow();
+	*(void **)&real = dlsym(RTLD_NEXT, "getgrouplist");
+	return real(name, gid, groups, ngroups);
+}
+
+int
+initgroups(const char *name, gid_t gid)
+{
+	int (*real)(const char *, gid_t);
+
+	slow();
+	*(void **)&real = dlsym(RTLD_NEXT, "initgroups");
+	return real(name, gid);
+}
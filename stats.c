@@ -0,0 +1,406 @@
+/*
+ * Copyright (c) 2016 Nathan Holstein <nathan.holstein@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <paths.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "policy.h"
+#include "doas.h"
+
+#define STATS_FILE	DOAS_RUNDIR "doas.stats"
+#define STATS_MAGIC	0x646f6173	/* "doas" */
+#define STATS_VERSION	1
+#define STATS_NLINES	16384
+
+#define METRICS_FILE	DOAS_RUNDIR "doas.metrics"
+#define METRICS_MAGIC	0x646f6d74	/* "domt" */
+#define METRICS_VERSION	2
+#define METRICS_NBUCKETS 26		/* 1us to 32s, plus overflow */
+
+/*
+ * The statistics file is a fixed size table of counters indexed by the
+ * line number of each rule in /etc/doas.conf; rules past STATS_NLINES
+ * are not counted.  It is shared by every concurrent doas process, so
+ * counters are only ever touched with atomic operations.  The header
+ * records which config the counters belong to; when the config changes
+ * the table is reset under the lock.  Processes still running with the
+ * old config see the new hash and stop counting.  It is only maintained
+ * if an administrator creates the file.
+ */
+struct statsfile {
+	uint32_t magic;
+	uint32_t version;
+	_Atomic uint64_t confighash;
+	uint32_t nlines;
+	uint32_t pad;
+	_Atomic uint64_t count[STATS_NLINES][STAT_NCOUNTERS];
+};
+
+/*
+ * The metrics file holds invocation counters and latency histograms.
+ * Bucket i counts latencies below 2^i microseconds; the last bucket
+ * catches everything slower.  It is only maintained if an administrator
+ * creates the file.
+ */
+struct histogram {
+	_Atomic uint64_t bucket[METRICS_NBUCKETS];
+	_Atomic uint64_t count;
+	_Atomic uint64_t sum;		/* microseconds */
+};
+
+struct metricsfile {
+	_Atomic uint32_t magic;
+	uint32_t version;
+	_Atomic uint64_t count[METRIC_NCOUNTERS];
+	struct histogram latency[LATENCY_NHISTS];
+};
+
+static struct statsfile *stats;
+static uint64_t statshash;
+static struct metricsfile *metrics;
+
+static const char *statnames[STAT_NCOUNTERS] = {
+	"match", "permit", "deny", "authfail",
+};
+
+static const char *metricnames[METRIC_NCOUNTERS] = {
+	"invocations", "permits", "denies", "auth_failures",
+};
+
+static const char *latencynames[LATENCY_NHISTS] = {
+	"parse", "permit", "auth", "usercontext", "preexec", "lockwait",
+};
+
+/*
+ * Take the exclusive lock of a shared file, recording how long that
+ * took: with many concurrent invocations this is where they queue.
+ */
+int
+sharedlock(int fd)
+{
+	struct timespec ts;
+	int ret;
+
+	metrics_start(&ts);
+	ret = flock(fd, LOCK_EX);
+	metrics_time(LATENCY_LOCKWAIT, &ts);
+	return ret;
+}
+
+/*
+ * Open and map a root-owned shared file of the given size, resizing it
+ * as needed; it is created with mode unless that is 0.  The caller
+ * checks the header of the returned mapping without locking, and takes
+ * the lock on *fdp only to initialize it.
+ */
+void *
+mapshared(const char *path, size_t size, mode_t mode, int *fdp)
+{
+	struct stat sb;
+	void *p;
+	int fd;
+
+	fd = open(path, O_RDWR | O_NOFOLLOW | O_CLOEXEC |
+	    (mode ? O_CREAT : 0), mode);
+	if (fd == -1)
+		return NULL;
+	if (fstat(fd, &sb) != 0)
+		goto fail;
+	if (!S_ISREG(sb.st_mode) || sb.st_uid != 0 ||
+	    (sb.st_mode & (S_IWGRP|S_IWOTH)) != 0)
+		goto fail;
+	if ((size_t)sb.st_size != size && ftruncate(fd, size) != 0)
+		goto fail;
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED)
+		goto fail;
+	*fdp = fd;
+	return p;
+
+fail:
+	close(fd);
+	return NULL;
+}
+
+static uint64_t
+load(const _Atomic uint64_t *v)
+{
+	return atomic_load_explicit((_Atomic uint64_t *)v,
+	    memory_order_relaxed);
+}
+
+static const void *
+readcounters(const char *path, size_t size)
+{
+	struct stat sb;
+	void *p;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd == -1)
+		err(1, "%s", path);
+	if (fstat(fd, &sb) != 0)
+		err(1, "%s", path);
+	if (!S_ISREG(sb.st_mode) || sb.st_uid != 0 ||
+	    (sb.st_mode & (S_IWGRP|S_IWOTH)) != 0 ||
+	    (size_t)sb.st_size != size)
+		errx(1, "%s: invalid file", path);
+	p = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED)
+		err(1, "mmap");
+	close(fd);
+	return p;
+}
+
+/* The hash is stored last, so a file that has it is complete. */
+static int
+statsvalid(struct statsfile *sf, uint64_t confighash)
+{
+	return atomic_load_explicit(&sf->confighash, memory_order_acquire) ==
+	    confighash && sf->magic == STATS_MAGIC &&
+	    sf->version == STATS_VERSION && sf->nlines == STATS_NLINES;
+}
+
+static void
+statsreset(struct statsfile *sf, uint64_t confighash)
+{
+	int line, i;
+
+	atomic_store_explicit(&sf->confighash, 0, memory_order_relaxed);
+	for (line = 0; line < STATS_NLINES; line++)
+		for (i = 0; i < STAT_NCOUNTERS; i++)
+			atomic_store_explicit(&sf->count[line][i], 0,
+			    memory_order_relaxed);
+	sf->magic = STATS_MAGIC;
+	sf->version = STATS_VERSION;
+	sf->nlines = STATS_NLINES;
+	atomic_store_explicit(&sf->confighash, confighash,
+	    memory_order_release);
+}
+
+/*
+ * Map the statistics file if it exists, resetting it if it belongs to a
+ * different config.  Failure is silent: statistics are best effort
+ * and must never get in the way of running a command.
+ */
+void
+stats_open(uint64_t confighash)
+{
+	struct statsfile *sf;
+	int fd;
+
+	if (!(sf = mapshared(STATS_FILE, sizeof(*sf), 0, &fd)))
+		return;
+	if (!statsvalid(sf, confighash)) {
+		sharedlock(fd);
+		if (!statsvalid(sf, confighash))
+			statsreset(sf, confighash);
+		flock(fd, LOCK_UN);
+	}
+	close(fd);
+	stats = sf;
+	statshash = confighash;
+}
+
+void
+stats_countline(int lineno, int counter)
+{
+	if (!stats || lineno <= 0 || lineno > STATS_NLINES ||
+	    load(&stats->confighash) != statshash)
+		return;
+	atomic_fetch_add_explicit(&stats->count[lineno - 1][counter], 1,
+	    memory_order_relaxed);
+}
+
+void
+stats_count(const struct rule *r, int counter)
+{
+	stats_countline(r->lineno, counter);
+}
+
+void
+stats_match(const struct rule *r)
+{
+	stats_count(r, STAT_MATCH);
+}
+
+void __dead
+stats_report(void)
+{
+	const struct statsfile *sf;
+	uint64_t v[STAT_NCOUNTERS];
+	int line, i;
+
+	sf = readcounters(STATS_FILE, sizeof(*sf));
+	if (sf->magic != STATS_MAGIC || sf->version != STATS_VERSION ||
+	    sf->nlines != STATS_NLINES)
+		errx(1, "%s: invalid statistics file", STATS_FILE);
+
+	printf("config %016" PRIx64 "\n", load(&sf->confighash));
+	printf("line");
+	for (i = 0; i < STAT_NCOUNTERS; i++)
+		printf("\t%s", statnames[i]);
+	printf("\n");
+	for (line = 0; line < STATS_NLINES; line++) {
+		int used = 0;
+		for (i = 0; i < STAT_NCOUNTERS; i++) {
+			v[i] = load(&sf->count[line][i]);
+			used |= v[i] != 0;
+		}
+		if (!used)
+			continue;
+		printf("%d", line + 1);
+		for (i = 0; i < STAT_NCOUNTERS; i++)
+			printf("\t%" PRIu64, v[i]);
+		printf("\n");
+	}
+	exit(0);
+}
+
+/* The magic number is stored last, so a file that has it is complete. */
+static int
+metricsvalid(struct metricsfile *mf)
+{
+	return atomic_load_explicit(&mf->magic, memory_order_acquire) ==
+	    METRICS_MAGIC && mf->version == METRICS_VERSION;
+}
+
+/*
+ * Map the metrics file if it exists.  Like the rule statistics this
+ * is best effort.
+ */
+void
+metrics_open(void)
+{
+	struct metricsfile *mf;
+	int fd;
+
+	if (!(mf = mapshared(METRICS_FILE, sizeof(*mf), 0, &fd)))
+		return;
+	if (!metricsvalid(mf)) {
+		sharedlock(fd);
+		if (!metricsvalid(mf)) {
+			atomic_store_explicit(&mf->magic, 0,
+			    memory_order_relaxed);
+			memset((char *)mf + sizeof(mf->magic), 0,
+			    sizeof(*mf) - sizeof(mf->magic));
+			mf->version = METRICS_VERSION;
+			atomic_store_explicit(&mf->magic, METRICS_MAGIC,
+			    memory_order_release);
+		}
+		flock(fd, LOCK_UN);
+	}
+	close(fd);
+	metrics = mf;
+	metrics_count(METRIC_INVOCATIONS);
+}
+
+void
+metrics_count(int counter)
+{
+	if (!metrics)
+		return;
+	atomic_fetch_add_explicit(&metrics->count[counter], 1,
+	    memory_order_relaxed);
+}
+
+/* May be called before metrics_open(), so that main() can time itself. */
+void
+metrics_start(struct timespec *ts)
+{
+	if (clock_gettime(CLOCK_MONOTONIC, ts) != 0)
+		ts->tv_sec = ts->tv_nsec = 0;
+}
+
+/* Record the time elapsed since metrics_start() in a histogram. */
+void
+metrics_time(int hist, const struct timespec *start)
+{
+	struct histogram *h;
+	struct timespec now;
+	uint64_t usec;
+	int b;
+
+	if (!metrics || (start->tv_sec == 0 && start->tv_nsec == 0) ||
+	    clock_gettime(CLOCK_MONOTONIC, &now) != 0)
+		return;
+	usec = (uint64_t)(now.tv_sec - start->tv_sec) * 1000000 +
+	    (now.tv_nsec - start->tv_nsec) / 1000;
+	for (b = 0; b < METRICS_NBUCKETS - 1; b++)
+		if (usec < (UINT64_C(1) << b))
+			break;
+
+	h = &metrics->latency[hist];
+	atomic_fetch_add_explicit(&h->bucket[b], 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&h->sum, usec, memory_order_relaxed);
+}
+
+/*
+ * Dump the metrics in the Prometheus text exposition format.  The
+ * counters are read without locking, so a histogram's count may be
+ * slightly ahead of or behind its buckets.
+ */
+void __dead
+metrics_report(void)
+{
+	const struct metricsfile *mf;
+	uint64_t cum;
+	int i, b;
+
+	mf = readcounters(METRICS_FILE, sizeof(*mf));
+	if (!metricsvalid((struct metricsfile *)mf))
+		errx(1, "%s: invalid metrics file", METRICS_FILE);
+
+	for (i = 0; i < METRIC_NCOUNTERS; i++) {
+		printf("# TYPE doas_%s_total counter\n", metricnames[i]);
+		printf("doas_%s_total %" PRIu64 "\n", metricnames[i],
+		    load(&mf->count[i]));
+	}
+	for (i = 0; i < LATENCY_NHISTS; i++) {
+		const struct histogram *h = &mf->latency[i];
+		printf("# TYPE doas_%s_seconds histogram\n", latencynames[i]);
+		for (b = 0, cum = 0; b < METRICS_NBUCKETS; b++) {
+			cum += load(&h->bucket[b]);
+			if (b < METRICS_NBUCKETS - 1)
+				printf("doas_%s_seconds_bucket{le=\"%.6f\"} %"
+				    PRIu64 "\n", latencynames[i],
+				    (double)(UINT64_C(1) << b) / 1e6, cum);
+			else
+				printf("doas_%s_seconds_bucket{le=\"+Inf\"} %"
+				    PRIu64 "\n", latencynames[i], cum);
+		}
+		printf("doas_%s_seconds_sum %.6f\n", latencynames[i],
+		    (double)load(&h->sum) / 1e6);
+		printf("doas_%s_seconds_count %" PRIu64 "\n", latencynames[i],
+		    load(&h->count));
+	}
+	exit(0);
+}